@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+
+#include "../src/colorconvert.h"
+
+/**
+ * Color conversion microbenchmark. Converts the same picture of PIX_FMT to
+ * YUV420P with `sws_scale()`, as the encoder did before it had its own
+ * kernels, and with each kernel of `src/colorconvert.c` the CPU has, then
+ * prints the average milliseconds per frame of each:
+ *
+ *     swscale_ms=4.21 c_ms=2.10 sse2_ms=0.61 avx2_ms=0.38
+ *
+ * Kernels the CPU lacks are printed as `-`. The YUV formats are repacked
+ * the same way whatever the kernel, so they only report `c_ms`.
+**/
+
+static const struct {
+  const char *name;
+  enum AVPixelFormat format;
+} formats[] = {
+  { "ABGR8888", AV_PIX_FMT_ABGR },
+  { "ARGB8888", AV_PIX_FMT_ARGB },
+  { "BGR888", AV_PIX_FMT_BGR24 },
+  { "BGRA8888", AV_PIX_FMT_BGRA },
+  { "RGB888", AV_PIX_FMT_RGB24 },
+  { "RGBA8888", AV_PIX_FMT_RGBA },
+  { "I420", AV_PIX_FMT_YUV420P },
+  { "NV12", AV_PIX_FMT_NV12 },
+  { "YUYV422", AV_PIX_FMT_YUYV422 },
+};
+
+static const char *isas[] = { "c", "sse2", "avx2" };
+
+
+static int64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+static void usage(const char *program) __attribute__ ((noreturn));
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-n FRAMES] WIDTH HEIGHT PIX_FMT\n", program);
+  exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+  int frames = 100;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        frames = atoi(optarg);
+        if (frames <= 0) usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 3) {
+    usage(argv[0]);
+  }
+
+  int width = atoi(argv[optind]);
+  int height = atoi(argv[optind + 1]);
+  enum AVPixelFormat format = AV_PIX_FMT_NONE;
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+    if (strcmp(formats[i].name, argv[optind + 2]) == 0) format = formats[i].format;
+  }
+  if (width <= 0 || height <= 0 || width % 2 || height % 2 || format == AV_PIX_FMT_NONE) {
+    usage(argv[0]);
+  }
+
+  uint8_t *src[4], *dst[4];
+  int srcStride[4], dstStride[4];
+  if (av_image_alloc(src, srcStride, width, height, format, 32) < 0 ||
+      av_image_alloc(dst, dstStride, width, height, AV_PIX_FMT_YUV420P, 32) < 0) {
+    fprintf(stderr, "unable to allocate pictures\n");
+    exit(1);
+  }
+  // Conversion time does not depend on the content, but keep it honest.
+  for (int i = 0; i < 4 && src[i]; ++i) {
+    int rows = i == 0 ? height : height / 2;
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < srcStride[i]; ++x) {
+        src[i][y * srcStride[i] + x] = (uint8_t)(x * 7 + y * 13);
+      }
+    }
+  }
+
+  struct SwsContext *context = sws_getContext(width, height, format, width, height,
+                                              AV_PIX_FMT_YUV420P, SWS_BICUBIC,
+                                              NULL, NULL, NULL);
+  if (!context) {
+    fprintf(stderr, "unable to create swscale context\n");
+    exit(1);
+  }
+  int64_t start = monotonic_ns();
+  for (int i = 0; i < frames; ++i) {
+    sws_scale(context, (const uint8_t *const *)src, srcStride, 0, height, dst, dstStride);
+  }
+  printf("swscale_ms=%.2f", (double)(monotonic_ns() - start) / 1e6 / frames);
+  sws_freeContext(context);
+
+  for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); ++k) {
+    int packed = color_convert_supported(format);
+    if (!color_convert_init(isas[k]) || (!packed && k > 0)) {
+      printf(" %s_ms=-", isas[k]);
+      continue;
+    }
+    start = monotonic_ns();
+    for (int i = 0; i < frames; ++i) {
+      if (packed) {
+        color_convert_yuv420p(format, width, height, src[0], srcStride[0], dst, dstStride);
+      } else {
+        color_repack_yuv420p(format, width, height, (const uint8_t *const *)src, srcStride,
+                             dst, dstStride);
+      }
+    }
+    printf(" %s_ms=%.2f", isas[k], (double)(monotonic_ns() - start) / 1e6 / frames);
+  }
+  printf("\n");
+
+  av_freep(&src[0]);
+  av_freep(&dst[0]);
+  return 0;
+}
@@ -0,0 +1,488 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Synthetic capture process for benchmarks. Writes `FRM\n` commands to the
+ * standard out, or to a `clouddisplayencoder -S` socket, stamped with the
+ * realtime clock like a real capture would be, so the player side can
+ * measure capture-to-display latency.
+**/
+
+// The scrolling text moves up by `SCROLL_SPEED` rows per frame and repeats
+// every `SCROLL_PERIOD` rows.
+#define SCROLL_SPEED 2
+#define SCROLL_PERIOD 512
+
+// Random values shared by all frames of the motion content, a prime so
+// that the pattern does not line up with rows.
+#define NOISE_SIZE 65521
+
+#pragma pack(push)
+#pragma pack(1)
+
+typedef struct {
+  char command[4];
+  uint64_t pts;
+} CommandData;
+
+// Same layout as the `SES\n` command of clouddisplayencoder.
+typedef struct {
+  char host[64];
+  uint16_t port;
+  uint32_t width;
+  uint32_t height;
+  char pixelFormat[16];
+  char audioFormat[16];
+  uint32_t sampleRate;
+} SessionData;
+
+#pragma pack(pop)
+
+typedef enum {
+  CHROMA_NONE, // RGB
+  CHROMA_PLANAR, // I420, U and V planes at half width and height
+  CHROMA_SEMI_PLANAR, // NV12, one plane of interleaved U and V at half height
+  CHROMA_PACKED // YUYV422, Y0 U Y1 V for each pair of pixels
+} Chroma;
+
+// Byte offsets of each channel in a pixel of the RGB formats, -1 when
+// absent. The YUV formats are written as BT.601 limited range, like the
+// encoder expects them.
+typedef struct {
+  const char *name;
+  int bytesPerPixel; // of the first plane
+  int red, green, blue, alpha;
+  Chroma chroma;
+} PixelLayout;
+
+static const PixelLayout layouts[] = {
+  { "ABGR8888", 4, 3, 2, 1, 0, CHROMA_NONE },
+  { "ARGB8888", 4, 1, 2, 3, 0, CHROMA_NONE },
+  { "BGR888", 3, 2, 1, 0, -1, CHROMA_NONE },
+  { "BGRA8888", 4, 2, 1, 0, 3, CHROMA_NONE },
+  { "RGB888", 3, 0, 1, 2, -1, CHROMA_NONE },
+  { "RGBA8888", 4, 0, 1, 2, 3, CHROMA_NONE },
+  { "I420", 1, -1, -1, -1, -1, CHROMA_PLANAR },
+  { "NV12", 1, -1, -1, -1, -1, CHROMA_SEMI_PLANAR },
+  { "YUYV422", 2, -1, -1, -1, -1, CHROMA_PACKED },
+};
+
+typedef enum {
+  CONTENT_STATIC, // the same picture over and over
+  CONTENT_SCROLL, // lines of text scrolling up, like a terminal or a web page
+  CONTENT_MOTION // every pixel changes, like a video
+} Content;
+
+// Rows are tightly packed in every plane, the way `FRM\n` sends them.
+typedef struct {
+  const PixelLayout *layout;
+  int width;
+  int height;
+  int planeCount;
+  uint8_t *planes[3];
+  size_t rowSizes[3];
+} Picture;
+
+
+/**
+ * Allocates the planes of `picture` for its layout and size.
+**/
+static void alloc_picture(Picture *picture) {
+  const PixelLayout *layout = picture->layout;
+  size_t width = (size_t)picture->width;
+  picture->planeCount = layout->chroma == CHROMA_PLANAR ? 3 :
+                        layout->chroma == CHROMA_SEMI_PLANAR ? 2 : 1;
+  picture->rowSizes[0] = width * (size_t)layout->bytesPerPixel;
+  picture->rowSizes[1] = layout->chroma == CHROMA_PLANAR ? width / 2 : width;
+  picture->rowSizes[2] = width / 2;
+
+  size_t size = 0;
+  for (int plane = 0; plane < picture->planeCount; ++plane) {
+    size += picture->rowSizes[plane] * (size_t)(plane == 0 ? picture->height : picture->height / 2);
+  }
+  uint8_t *data = malloc(size);
+  if (!data) {
+    fprintf(stderr, "unable to allocate the picture\n");
+    exit(1);
+  }
+  for (int plane = 0; plane < picture->planeCount; ++plane) {
+    picture->planes[plane] = data;
+    data += picture->rowSizes[plane] * (size_t)(plane == 0 ? picture->height : picture->height / 2);
+  }
+}
+
+
+static inline void put_pixel(Picture *picture, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+  const PixelLayout *layout = picture->layout;
+  if (layout->chroma == CHROMA_NONE) {
+    uint8_t *pixel = picture->planes[0] + (size_t)y * picture->rowSizes[0] + (size_t)x * (size_t)layout->bytesPerPixel;
+    pixel[layout->red] = r;
+    pixel[layout->green] = g;
+    pixel[layout->blue] = b;
+    if (layout->alpha >= 0) pixel[layout->alpha] = 255;
+    return;
+  }
+
+  uint8_t luma = (uint8_t)(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+  uint8_t u = (uint8_t)(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+  uint8_t v = (uint8_t)(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+  // Chroma is taken from the top left pixel it covers.
+  if (layout->chroma == CHROMA_PACKED) {
+    uint8_t *pixel = picture->planes[0] + (size_t)y * picture->rowSizes[0] + (size_t)x * 2;
+    pixel[0] = luma;
+    if (x % 2 == 0) {
+      pixel[1] = u;
+      pixel[3] = v;
+    }
+    return;
+  }
+  picture->planes[0][(size_t)y * picture->rowSizes[0] + (size_t)x] = luma;
+  if (x % 2 || y % 2) return;
+  size_t row = (size_t)(y / 2);
+  if (layout->chroma == CHROMA_PLANAR) {
+    picture->planes[1][row * picture->rowSizes[1] + (size_t)(x / 2)] = u;
+    picture->planes[2][row * picture->rowSizes[2] + (size_t)(x / 2)] = v;
+  } else {
+    picture->planes[1][row * picture->rowSizes[1] + (size_t)x] = u;
+    picture->planes[1][row * picture->rowSizes[1] + (size_t)x + 1] = v;
+  }
+}
+
+
+static inline uint32_t hash(uint32_t value) {
+  value ^= value >> 16;
+  value *= 0x7feb352d;
+  value ^= value >> 15;
+  value *= 0x846ca68b;
+  value ^= value >> 16;
+  return value;
+}
+
+
+/**
+ * Eight color bars over a horizontal gradient.
+**/
+static void draw_static(Picture *picture) {
+  static const uint8_t bars[8][3] = {
+    { 192, 192, 192 }, { 192, 192, 0 }, { 0, 192, 192 }, { 0, 192, 0 },
+    { 192, 0, 192 }, { 192, 0, 0 }, { 0, 0, 192 }, { 16, 16, 16 },
+  };
+  for (int y = 0; y < picture->height; ++y) {
+    for (int x = 0; x < picture->width; ++x) {
+      if (y < picture->height * 3 / 4) {
+        const uint8_t *bar = bars[x * 8 / picture->width];
+        put_pixel(picture, x, y, bar[0], bar[1], bar[2]);
+      } else {
+        uint8_t level = (uint8_t)(x * 255 / picture->width);
+        put_pixel(picture, x, y, level, level, level);
+      }
+    }
+  }
+}
+
+
+/**
+ * Dark 8x16 glyphs on a white page. The text repeats every
+ * `SCROLL_PERIOD` rows, so `picture` must be `SCROLL_PERIOD` rows taller
+ * than a frame, and frame `i` starts at row `i * SCROLL_SPEED % SCROLL_PERIOD`.
+ * Glyphs are random dots, which is what matters to the encoder.
+**/
+static void draw_scroll(Picture *picture) {
+  for (int y = 0; y < picture->height; ++y) {
+    uint32_t row = (uint32_t)y % SCROLL_PERIOD;
+    uint32_t line = row / 16;
+    uint32_t glyphRow = row % 16;
+    // Lines have a ragged right margin and a blank line every so often.
+    uint32_t lineLength = hash(line) % 5 ? (uint32_t)picture->width / 8 * (40 + hash(line) % 60) / 100 : 0;
+    for (int x = 0; x < picture->width; ++x) {
+      uint32_t column = (uint32_t)x / 8;
+      uint32_t glyph = hash(line * 4099 + column);
+      int ink = column < lineLength && glyph % 7 != 0 && // spaces
+                glyphRow >= 3 && glyphRow < 13 && x % 8 < 6 &&
+                (hash(glyph + glyphRow * 8 + (uint32_t)x % 8) & 3) == 0;
+      if (ink) {
+        put_pixel(picture, x, y, 32, 32, 32);
+      } else {
+        put_pixel(picture, x, y, 250, 250, 250);
+      }
+    }
+  }
+}
+
+
+/**
+ * `draw_motion()` for the YUV formats, with the same gradients drawn
+ * straight into the luma and chroma samples.
+**/
+static void draw_motion_yuv(Picture *picture, const uint8_t *noise, int frameIndex) {
+  const Chroma chroma = picture->layout->chroma;
+  size_t noiseIndex = hash((uint32_t)frameIndex) % NOISE_SIZE;
+  for (int y = 0; y < picture->height; ++y) {
+    uint8_t rowLuma = (uint8_t)(y - frameIndex * 2);
+    uint8_t *luma = picture->planes[0] + (size_t)y * picture->rowSizes[0];
+    int lumaStep = chroma == CHROMA_PACKED ? 2 : 1;
+    for (int x = 0; x < picture->width; ++x) {
+      uint8_t grain = noise[noiseIndex];
+      noiseIndex = noiseIndex + 1 < NOISE_SIZE ? noiseIndex + 1 : 0;
+      // Keeps to the limited range, 16 to 235.
+      luma[x * lumaStep] = (uint8_t)(16 + ((uint8_t)(x / 2 + rowLuma + frameIndex * 3) * 205 >> 8) + grain);
+    }
+
+    uint8_t *u, *v;
+    int chromaStep;
+    if (chroma == CHROMA_PACKED) {
+      u = luma + 1;
+      v = luma + 3;
+      chromaStep = 4;
+    } else if (y % 2) {
+      continue;
+    } else if (chroma == CHROMA_PLANAR) {
+      u = picture->planes[1] + (size_t)(y / 2) * picture->rowSizes[1];
+      v = picture->planes[2] + (size_t)(y / 2) * picture->rowSizes[2];
+      chromaStep = 1;
+    } else {
+      u = picture->planes[1] + (size_t)(y / 2) * picture->rowSizes[1];
+      v = u + 1;
+      chromaStep = 2;
+    }
+    uint8_t rowU = (uint8_t)(y / 2 + frameIndex * 5);
+    for (int x = 0; x < picture->width / 2; ++x) {
+      u[x * chromaStep] = (uint8_t)(16 + ((uint8_t)(rowU + x) * 224 >> 8));
+      v[x * chromaStep] = (uint8_t)(16 + ((uint8_t)(x * 2 + frameIndex * 3) * 224 >> 8));
+    }
+  }
+}
+
+
+/**
+ * Moving gradients with some noise, so that no two frames share a block.
+ * `noise` holds `NOISE_SIZE` random values below 16.
+**/
+static void draw_motion(Picture *picture, const uint8_t *noise, int frameIndex) {
+  if (picture->layout->chroma != CHROMA_NONE) {
+    draw_motion_yuv(picture, noise, frameIndex);
+    return;
+  }
+  // Copied out of the layout, which the compiler cannot tell apart from
+  // the pixels.
+  const int red = picture->layout->red, green = picture->layout->green;
+  const int blue = picture->layout->blue, alpha = picture->layout->alpha;
+  const int bytesPerPixel = picture->layout->bytesPerPixel;
+  size_t noiseIndex = hash((uint32_t)frameIndex) % NOISE_SIZE;
+  uint8_t *pixel = picture->planes[0];
+  for (int y = 0; y < picture->height; ++y) {
+    uint8_t rowGreen = (uint8_t)(y * 2 - frameIndex * 2);
+    uint8_t rowBlue = (uint8_t)(y / 2 + frameIndex * 5);
+    for (int x = 0; x < picture->width; ++x) {
+      uint8_t grain = noise[noiseIndex];
+      noiseIndex = noiseIndex + 1 < NOISE_SIZE ? noiseIndex + 1 : 0;
+      pixel[red] = (uint8_t)(x + frameIndex * 3 + grain);
+      pixel[green] = (uint8_t)(rowGreen + grain);
+      pixel[blue] = (uint8_t)(rowBlue + x / 2);
+      if (alpha >= 0) pixel[alpha] = 255;
+      pixel += bytesPerPixel;
+    }
+  }
+}
+
+
+/**
+ * Writes the `height` rows of every plane of `picture` starting at row
+ * `firstRow`, which is even, as the data of an `FRM\n`.
+**/
+static int write_picture(FILE *output, const Picture *picture, int firstRow, int height) {
+  for (int plane = 0; plane < picture->planeCount; ++plane) {
+    int subsampled = plane > 0;
+    size_t rowSize = picture->rowSizes[plane];
+    size_t size = rowSize * (size_t)(height >> subsampled);
+    if (fwrite(picture->planes[plane] + (size_t)(firstRow >> subsampled) * rowSize, 1, size, output) != size) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static int64_t realtime_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+ * Connects to the encoder socket at `path` and starts a session sending to
+ * `destination` (DEST_IP:DEST_PORT).
+**/
+static FILE *open_session(const char *path, const char *destination, const Picture *picture) {
+  SessionData session;
+  memset(&session, 0, sizeof(session));
+  const char *separator = strrchr(destination, ':');
+  if (!separator || (size_t)(separator - destination) >= sizeof(session.host)) {
+    fprintf(stderr, "invalid destination: %s\n", destination);
+    exit(1);
+  }
+  memcpy(session.host, destination, (size_t)(separator - destination));
+  session.port = (uint16_t)atoi(separator + 1);
+  session.width = (uint32_t)picture->width;
+  session.height = (uint32_t)picture->height;
+  strncpy(session.pixelFormat, picture->layout->name, sizeof(session.pixelFormat));
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("unable to connect to the encoder");
+    exit(1);
+  }
+  FILE *output = fdopen(fd, "w");
+  if (!output) {
+    perror("unable to open the encoder socket");
+    exit(1);
+  }
+
+  CommandData header;
+  memcpy(header.command, "SES\n", 4);
+  header.pts = (uint64_t)realtime_us();
+  if (fwrite(&header, sizeof(header), 1, output) != 1 ||
+      fwrite(&session, sizeof(session), 1, output) != 1) {
+    perror("unable to start the session");
+    exit(1);
+  }
+  return output;
+}
+
+
+static void usage(const char *program) __attribute__ ((noreturn));
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-c static|scroll|motion] [-n FRAMES] [-f FPS] [-S SOCKET_PATH -d DEST_IP:DEST_PORT] WIDTH HEIGHT PIX_FMT\n", program);
+  exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+  Content content = CONTENT_MOTION;
+  int frameCount = 300;
+  double fps = 0; // as fast as the encoder reads
+  const char *socketPath = NULL;
+  const char *destination = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:f:S:d:")) != -1) {
+    switch (opt) {
+      case 'c':
+        if (strcmp(optarg, "static") == 0) {
+          content = CONTENT_STATIC;
+        } else if (strcmp(optarg, "scroll") == 0) {
+          content = CONTENT_SCROLL;
+        } else if (strcmp(optarg, "motion") == 0) {
+          content = CONTENT_MOTION;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'n':
+        frameCount = atoi(optarg);
+        if (frameCount <= 0) usage(argv[0]);
+        break;
+      case 'f':
+        fps = atof(optarg);
+        if (fps < 0) usage(argv[0]);
+        break;
+      case 'S':
+        socketPath = optarg;
+        break;
+      case 'd':
+        destination = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 3 || !socketPath != !destination) {
+    usage(argv[0]);
+  }
+
+  Picture picture;
+  picture.width = atoi(argv[optind]);
+  picture.height = atoi(argv[optind + 1]);
+  picture.layout = NULL;
+  for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+    if (strcmp(argv[optind + 2], layouts[i].name) == 0) {
+      picture.layout = &layouts[i];
+    }
+  }
+  if (picture.width <= 0 || picture.height <= 0 || !picture.layout) {
+    usage(argv[0]);
+  }
+  // Chroma is shared by pairs of pixels, like the encoder requires.
+  if (picture.layout->chroma != CHROMA_NONE && (picture.width % 2 || picture.height % 2)) {
+    usage(argv[0]);
+  }
+  int frameHeight = picture.height;
+
+  FILE *output = socketPath ? open_session(socketPath, destination, &picture) : stdout;
+
+  // Frames are rendered ahead when possible, so that the source is not
+  // what limits the throughput.
+  uint8_t noise[NOISE_SIZE];
+  if (content == CONTENT_SCROLL) {
+    picture.height += SCROLL_PERIOD;
+  }
+  alloc_picture(&picture);
+  if (content == CONTENT_STATIC) {
+    draw_static(&picture);
+  } else if (content == CONTENT_SCROLL) {
+    draw_scroll(&picture);
+  } else {
+    for (size_t i = 0; i < NOISE_SIZE; ++i) {
+      noise[i] = (uint8_t)(hash((uint32_t)i) >> 28);
+    }
+  }
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  long interval = fps > 0 ? (long)(1e9 / fps) : 0;
+  for (int i = 0; i < frameCount; ++i) {
+    int firstRow = 0;
+    if (content == CONTENT_SCROLL) {
+      firstRow = i * SCROLL_SPEED % SCROLL_PERIOD;
+    } else if (content == CONTENT_MOTION) {
+      draw_motion(&picture, noise, i);
+    }
+
+    if (interval) {
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) {}
+      next.tv_nsec += interval;
+      next.tv_sec += next.tv_nsec / 1000000000;
+      next.tv_nsec %= 1000000000;
+    }
+
+    CommandData header;
+    memcpy(header.command, "FRM\n", 4);
+    header.pts = (uint64_t)realtime_us();
+    if (fwrite(&header, sizeof(header), 1, output) != 1 ||
+        !write_picture(output, &picture, firstRow, frameHeight) ||
+        fflush(output) != 0) {
+      perror("unable to write frame");
+      exit(1);
+    }
+  }
+
+  fclose(output);
+  free(picture.planes[0]);
+  return 0;
+}
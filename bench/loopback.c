@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+/**
+ * Headless player for benchmarks. Receives and decodes the stream of
+ * `clouddisplayencoder` like `clouddisplayplayer` does, without displaying
+ * it, and prints a summary once the stream stops:
+ *
+ *     frames=300 fps=30.0 p50=12.3ms p99=20.1ms bits_per_frame=41234 decode_ms=1.52
+ *
+ * Latency goes from the capture timestamp of a frame to the end of its
+ * decoding, so the capture clock must be this host's realtime clock.
+ * `decode_ms` is the average time spent decoding a packet, with the same
+ * threading options as `clouddisplayplayer`.
+**/
+
+typedef struct {
+  int64_t *values;
+  size_t count;
+  size_t capacity;
+} Samples;
+
+
+static void samples_add(Samples *samples, int64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    samples->values = realloc(samples->values, samples->capacity * sizeof(int64_t));
+    if (!samples->values) {
+      fprintf(stderr, "unable to allocate samples\n");
+      exit(1);
+    }
+  }
+  samples->values[samples->count++] = value;
+}
+
+
+static int compare_samples(const void *a, const void *b) {
+  int64_t left = *(const int64_t *)a;
+  int64_t right = *(const int64_t *)b;
+  return (left > right) - (left < right);
+}
+
+
+/**
+ * Nearest rank `percentile` of `samples`, which must be sorted.
+**/
+static int64_t samples_percentile(const Samples *samples, double percentile) {
+  if (samples->count == 0) return 0;
+  size_t rank = (size_t)(percentile * (double)samples->count + 0.999999);
+  if (rank < 1) rank = 1;
+  if (rank > samples->count) rank = samples->count;
+  return samples->values[rank - 1];
+}
+
+
+/**
+ * Capture time in microseconds of timestamp `pts` of `stream`, taking the
+ * wrap of the timestamps into account like `clouddisplayplayer` does.
+**/
+static int64_t capture_time(const AVStream *stream, int64_t pts, int64_t now) {
+  int64_t wrap = 1LL << stream->pts_wrap_bits;
+  int64_t elapsed = (av_rescale_q(now, AV_TIME_BASE_Q, stream->time_base) - pts) % wrap;
+  if (elapsed < 0) elapsed += wrap;
+  if (elapsed > wrap / 2) elapsed -= wrap;
+  return now - av_rescale_q(elapsed, stream->time_base, AV_TIME_BASE_Q);
+}
+
+
+static void usage(const char *program) __attribute__ ((noreturn));
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-t IDLE_SECONDS] [-n FRAMES] [-j DECODE_THREADS] [-F] SRC_IP SRC_PORT\n", program);
+  exit(1);
+}
+
+
+int main(int argc, char *argv[]) {
+  int idleSeconds = 2;
+  int maxFrames = 0;
+  int decodeThreads = 1;
+  int frameThreads = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:j:F")) != -1) {
+    switch (opt) {
+      case 't':
+        idleSeconds = atoi(optarg);
+        if (idleSeconds <= 0) usage(argv[0]);
+        break;
+      case 'n':
+        maxFrames = atoi(optarg);
+        if (maxFrames <= 0) usage(argv[0]);
+        break;
+      case 'j':
+        decodeThreads = atoi(optarg);
+        if (decodeThreads < 0) usage(argv[0]);
+        break;
+      case 'F':
+        frameThreads = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+
+  av_register_all();
+  avformat_network_init();
+
+  // The stream ends when nothing arrives for `idleSeconds`.
+  char url[256];
+  snprintf(url, sizeof(url), "udp://%s:%s?timeout=%lld", argv[optind], argv[optind + 1],
+           (long long)idleSeconds * 1000000);
+  AVFormatContext *formatCtx = NULL;
+  if (avformat_open_input(&formatCtx, url, NULL, NULL) != 0) {
+    fprintf(stderr, "unable to open %s\n", url);
+    exit(1);
+  }
+  if (avformat_find_stream_info(formatCtx, NULL) < 0) {
+    fprintf(stderr, "unable to find stream information\n");
+    exit(1);
+  }
+  // Frames captured while the stream was probed waited for it, they are
+  // decoded but not timed.
+  int64_t openedAt = av_gettime();
+
+  int videoStream = -1;
+  for (unsigned i = 0; i < formatCtx->nb_streams; ++i) {
+    if (formatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+      videoStream = (int)i;
+      break;
+    }
+  }
+  if (videoStream < 0) {
+    fprintf(stderr, "unable to find a video in the stream\n");
+    exit(1);
+  }
+  AVStream *stream = formatCtx->streams[videoStream];
+  AVCodecContext *codecCtx = stream->codec;
+  AVCodec *codec = avcodec_find_decoder(codecCtx->codec_id);
+  codecCtx->thread_count = decodeThreads;
+  if (frameThreads) {
+    codecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  } else {
+    // Frame threads would add a frame of latency per thread.
+    codecCtx->thread_type = FF_THREAD_SLICE;
+    codecCtx->flags |= CODEC_FLAG_LOW_DELAY;
+  }
+  if (!codec || avcodec_open2(codecCtx, codec, NULL) < 0) {
+    fprintf(stderr, "unable to open video codec\n");
+    exit(1);
+  }
+
+  AVFrame *frame = avcodec_alloc_frame();
+  AVPacket packet;
+  Samples latencies = { NULL, 0, 0 };
+  int frames = 0;
+  int packets = 0;
+  int64_t bytes = 0;
+  int64_t decodeTime = 0;
+  int64_t firstFrameTime = 0;
+  int64_t lastFrameTime = 0;
+  while ((!maxFrames || frames < maxFrames) && av_read_frame(formatCtx, &packet) >= 0) {
+    if (packet.stream_index == videoStream) {
+      ++packets;
+      bytes += packet.size;
+
+      int frameFinished = 0;
+      int64_t start = av_gettime();
+      avcodec_decode_video2(codecCtx, frame, &frameFinished, &packet);
+      int64_t now = av_gettime();
+      decodeTime += now - start;
+      if (frameFinished) {
+        if (frames++ == 0) firstFrameTime = now;
+        lastFrameTime = now;
+
+        int64_t pts = av_frame_get_best_effort_timestamp(frame);
+        if (pts != AV_NOPTS_VALUE) {
+          int64_t captured = capture_time(stream, pts, now);
+          if (captured >= openedAt) {
+            samples_add(&latencies, now - captured);
+          }
+        }
+      }
+    }
+    av_free_packet(&packet);
+  }
+
+  qsort(latencies.values, latencies.count, sizeof(int64_t), compare_samples);
+  double seconds = (double)(lastFrameTime - firstFrameTime) / 1e6;
+  printf("frames=%d fps=%.1f p50=%.1fms p99=%.1fms bits_per_frame=%.0f decode_ms=%.2f\n",
+         frames,
+         frames > 1 && seconds > 0 ? (frames - 1) / seconds : 0.0,
+         (double)samples_percentile(&latencies, 0.5) / 1000.0,
+         (double)samples_percentile(&latencies, 0.99) / 1000.0,
+         packets ? (double)bytes * 8.0 / packets : 0.0,
+         packets ? (double)decodeTime / 1000.0 / packets : 0.0);
+
+  free(latencies.values);
+  av_free(frame);
+  avcodec_close(codecCtx);
+  avformat_close_input(&formatCtx);
+  return 0;
+}
@@ -0,0 +1,251 @@
+#!/bin/sh
+# Benchmarks clouddisplayencoder with synthetic content, run by `make bench`.
+#
+# 1. Encoder throughput: frames are fed as fast as the encoder reads them.
+# 2. Loopback: frames are captured at BENCH_FPS and decoded on 127.0.0.1,
+#    reporting frame rate, capture-to-decode latency, bits per frame and
+#    encoding time per frame, intra only and with `-g BENCH_REFRESH` intra
+#    refresh.
+# 3. Pacing: the loopback with the datagrams of each packet sent at once
+#    and spread over a frame interval (`-p`), reporting latency and the
+#    datagrams and sendmmsg() syscalls per frame from the encoder's stats.
+# 4. Conversion slices: motion at BENCH_FPS converted in each of
+#    BENCH_SLICES slices (`-s`), reporting the `convert` stage time of the
+#    last `-M` report, for every format and size.
+# 5. Sessions per core: BENCH_SESSIONS concurrent sessions in one `-S`
+#    encoder, each at BENCH_FPS, then as many separate encoder processes.
+# 6. Decoding threads: intra-only streams of BENCH_DECODE_SIZES decoded
+#    with each of BENCH_DECODE_THREADS slice threads (0 is one per core).
+# 7. Color conversion: sws_scale against each conversion kernel, per
+#    format and size, on one core.
+#
+# Every list below can be overridden from the environment.
+
+FORMATS=${BENCH_FORMATS:-"ABGR8888 ARGB8888 BGR888 BGRA8888 RGB888 RGBA8888 I420 NV12 YUYV422"}
+SIZES=${BENCH_SIZES:-"1280x720 1920x1080"}
+CONTENTS=${BENCH_CONTENTS:-"static scroll motion"}
+FRAMES=${BENCH_FRAMES:-300}
+FPS=${BENCH_FPS:-30}
+REFRESH=${BENCH_REFRESH:-$FPS}
+SLICES=${BENCH_SLICES:-"1 2 4 8"}
+SESSIONS=${BENCH_SESSIONS:-"1 2 4 8"}
+SESSION_SIZE=${BENCH_SESSION_SIZE:-1280x720}
+DECODE_SIZES=${BENCH_DECODE_SIZES:-"2560x1440 3840x2160"}
+DECODE_THREADS=${BENCH_DECODE_THREADS:-"1 2 4 0"}
+PORT=${BENCH_PORT:-45000}
+
+ENCODER=./clouddisplayencoder
+SOURCE=bench/framesource
+LOOPBACK=bench/loopback
+CONVERT=bench/convert
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() {
+  echo $(($(date +%s%N) / 1000000))
+}
+
+field() {
+  # Value of `name=value` field $1 in the loopback summary $2.
+  echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+
+echo "== Encoder throughput ($FRAMES frames, unpaced)"
+printf '%-9s %-10s %-7s %9s %8s %8s %10s %12s\n' \
+  PIX_FMT SIZE CONTENT INPUT_FPS ENCODED SKIPPED BYTES/FRM ENCODE_MS/FRM
+for size in $SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for format in $FORMATS; do
+    for content in $CONTENTS; do
+      # Something has to receive the datagrams, the stream is not checked.
+      $LOOPBACK -t 1 127.0.0.1 $PORT > /dev/null 2>&1 &
+      receiver=$!
+      start=$(now_ms)
+      # -K so that every frame is encoded rather than the newest ones.
+      $SOURCE -c $content -n $FRAMES $width $height $format |
+        $ENCODER -K -r $FPS 127.0.0.1 $PORT $width $height $format 2> "$WORK/encoder.log"
+      end=$(now_ms)
+      kill $receiver 2> /dev/null
+      wait $receiver 2> /dev/null
+
+      encoded=$(sed -n 's/^encoded \([0-9]*\) frames, skipped \([0-9]*\).*/\1 \2/p' "$WORK/encoder.log")
+      perFrame=$(sed -n 's/^\([0-9]*\) bytes per frame, \([0-9.]*\) ms encoding.*/\1 \2/p' "$WORK/encoder.log")
+      printf '%-9s %-10s %-7s %9s %8s %8s %10s %12s\n' $format $size $content \
+        $(awk "BEGIN { printf \"%.1f\", $FRAMES * 1000 / ($end - $start + 1) }") \
+        ${encoded:-- -} ${perFrame:-- -}
+    done
+  done
+done
+
+
+echo
+echo "== Loopback on 127.0.0.1 ($FRAMES frames at $FPS fps, BGRA8888)"
+printf '%-10s %-7s %-7s %8s %7s %9s %9s %14s %12s\n' \
+  SIZE CONTENT GOP FRAMES FPS P50 P99 BITS/FRAME ENCODE_MS/FRM
+for size in $SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for content in $CONTENTS; do
+    for refresh in 0 $REFRESH; do
+      $LOOPBACK 127.0.0.1 $PORT > "$WORK/loopback.out" &
+      receiver=$!
+      sleep 0.5
+      $SOURCE -c $content -n $FRAMES -f $FPS $width $height BGRA8888 |
+        $ENCODER -r $FPS -g $refresh 127.0.0.1 $PORT $width $height BGRA8888 2> "$WORK/encoder.log"
+      wait $receiver
+      summary=$(cat "$WORK/loopback.out")
+      encodeMs=$(sed -n 's/^[0-9]* bytes per frame, \([0-9.]*\) ms encoding.*/\1/p' "$WORK/encoder.log")
+      if [ $refresh -eq 0 ]; then gop=intra; else gop=$refresh; fi
+      printf '%-10s %-7s %-7s %8s %7s %9s %9s %14s %12s\n' $size $content $gop \
+        "$(field frames "$summary")" "$(field fps "$summary")" "$(field p50 "$summary")" \
+        "$(field p99 "$summary")" "$(field bits_per_frame "$summary")" "${encodeMs:--}"
+    done
+  done
+done
+
+
+echo
+interval=$((1000000 / FPS))
+echo "== Pacing (motion, $FRAMES frames at $FPS fps, BGRA8888)"
+printf '%-10s %-9s %7s %9s %9s %11s %12s %9s\n' \
+  SIZE PACING_US FPS P50 P99 DGRAMS/FRM SYSCALLS/FRM MAX_BURST
+for size in $SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for pacing in 0 $interval; do
+    $LOOPBACK 127.0.0.1 $PORT > "$WORK/loopback.out" &
+    receiver=$!
+    sleep 0.5
+    $SOURCE -c motion -n $FRAMES -f $FPS $width $height BGRA8888 |
+      $ENCODER -r $FPS -p $pacing 127.0.0.1 $PORT $width $height BGRA8888 2> "$WORK/encoder.log"
+    wait $receiver
+    summary=$(cat "$WORK/loopback.out")
+    # A sender without batching would make one syscall per datagram.
+    sent=$(sed -n 's/^encoded \([0-9]*\) frames.*/\1/p; s/^sent \([0-9]*\) datagrams in \([0-9]*\) syscalls.*(max \([0-9]*\)).*/\1 \2 \3/p' \
+      "$WORK/encoder.log" | tr '\n' ' ')
+    printf '%-10s %-9s %7s %9s %9s %11s %12s %9s\n' $size $pacing \
+      "$(field fps "$summary")" "$(field p50 "$summary")" "$(field p99 "$summary")" \
+      $(echo $sent | awk '$1 > 0 { printf "%.1f %.1f %s", $2 / $1, $3 / $1, $4; next } { print "- - -" }')
+  done
+done
+
+
+echo
+# Three seconds, so that the last report covers a whole second of frames.
+sliceFrames=$((FPS * 3))
+echo "== Conversion slices (motion, $sliceFrames frames at $FPS fps, convert stage time)"
+printf '%-9s %-10s %7s %10s %10s\n' PIX_FMT SIZE SLICES P50 P99
+for size in $SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for format in $FORMATS; do
+    for slices in $SLICES; do
+      $LOOPBACK -t 1 127.0.0.1 $PORT > /dev/null 2>&1 &
+      receiver=$!
+      rm -f "$WORK/stats"
+      $SOURCE -c motion -n $sliceFrames -f $FPS $width $height $format |
+        $ENCODER -K -r $FPS -s $slices -M "$WORK/stats" 127.0.0.1 $PORT $width $height $format 2> /dev/null
+      kill $receiver 2> /dev/null
+      wait $receiver 2> /dev/null
+      convert=$(grep '^convert ' "$WORK/stats" 2> /dev/null)
+      printf '%-9s %-10s %7s %10s %10s\n' $format $size $slices \
+        "$(field p50 "$convert")" "$(field p99 "$convert")"
+    done
+  done
+done
+
+
+echo
+cores=$(getconf _NPROCESSORS_ONLN)
+echo "== Sessions per core ($SESSION_SIZE motion at $FPS fps, $cores cores)"
+printf '%-9s %8s %9s %9s %9s\n' MODEL SESSIONS MIN_FPS MAX_P50 MAX_P99
+width=${SESSION_SIZE%x*}
+height=${SESSION_SIZE#*x}
+socket="$WORK/encoder.sock"
+$ENCODER -r $FPS -S "$socket" 2> /dev/null &
+server=$!
+sleep 0.5
+# `server` runs every session in the `-S` encoder, `processes` runs one
+# encoder process per session as the baseline.
+for model in server processes; do
+  sustained=0
+  for count in $SESSIONS; do
+    receivers=""
+    i=0
+    while [ $i -lt $count ]; do
+      $LOOPBACK 127.0.0.1 $((PORT + i)) > "$WORK/session$i.out" &
+      receivers="$receivers $!"
+      i=$((i + 1))
+    done
+    sleep 0.5
+    sources=""
+    i=0
+    while [ $i -lt $count ]; do
+      if [ $model = server ]; then
+        $SOURCE -c motion -n $FRAMES -f $FPS -S "$socket" -d 127.0.0.1:$((PORT + i)) \
+          $width $height BGRA8888 &
+      else
+        $SOURCE -c motion -n $FRAMES -f $FPS $width $height BGRA8888 |
+          $ENCODER -r $FPS 127.0.0.1 $((PORT + i)) $width $height BGRA8888 2> /dev/null &
+      fi
+      sources="$sources $!"
+      i=$((i + 1))
+    done
+    wait $sources $receivers
+
+    summaries=$(cat "$WORK"/session*.out)
+    rm -f "$WORK"/session*.out
+    result=$(echo "$summaries" | tr ' ' '\n' | awk -F= '
+      $1 == "fps" { if (min == "" || $2 < min) min = $2 }
+      $1 == "p50" { v = $2 + 0; if (v > p50) p50 = v }
+      $1 == "p99" { v = $2 + 0; if (v > p99) p99 = v }
+      END { printf "%.1f %.1fms %.1fms", min, p50, p99 }')
+    printf '%-9s %8s %9s %9s %9s\n' $model $count $result
+    # A session keeps up when it shows at least 95% of the captured frames.
+    if awk "BEGIN { exit !(${result%% *} >= $FPS * 0.95) }"; then
+      sustained=$count
+    fi
+  done
+  awk "BEGIN { printf \"%s: %d sessions sustained, %.2f per core\n\", \"$model\", $sustained, $sustained / $cores }"
+done
+kill $server 2> /dev/null
+wait $server 2> /dev/null
+
+
+echo
+echo "== Decoding threads (motion, intra only, $FRAMES frames at $FPS fps)"
+printf '%-10s %7s %7s %10s %9s\n' SIZE THREADS FPS DECODE_MS P50
+for size in $DECODE_SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for threads in $DECODE_THREADS; do
+    $LOOPBACK -j $threads 127.0.0.1 $PORT > "$WORK/loopback.out" &
+    receiver=$!
+    sleep 0.5
+    # Slice threads need slices: x264 cuts a frame into one per thread.
+    $SOURCE -c motion -n $FRAMES -f $FPS $width $height BGRA8888 |
+      $ENCODER -r $FPS 127.0.0.1 $PORT $width $height BGRA8888 2> /dev/null
+    wait $receiver
+    summary=$(cat "$WORK/loopback.out")
+    printf '%-10s %7s %7s %10s %9s\n' $size $threads \
+      "$(field fps "$summary")" "$(field decode_ms "$summary")" "$(field p50 "$summary")"
+  done
+done
+
+
+echo
+echo "== Color conversion to YUV420P ($FRAMES frames, ms per frame)"
+printf '%-9s %-10s %10s %8s %8s %8s\n' PIX_FMT SIZE SWSCALE C SSE2 AVX2
+for size in $SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  for format in $FORMATS; do
+    summary=$($CONVERT -n $FRAMES $width $height $format)
+    printf '%-9s %-10s %10s %8s %8s %8s\n' $format $size \
+      "$(field swscale_ms "$summary")" "$(field c_ms "$summary")" \
+      "$(field sse2_ms "$summary")" "$(field avx2_ms "$summary")"
+  done
+done
@@ -1,17 +1,35 @@
+import argparse
 import glob
 import struct
 import subprocess
-import sys
 import time
 from PIL import Image
 
 
 if __name__ == '__main__':
-    ffmpeg = subprocess.Popen(['./clouddisplayencoder', '10.0.33.210', '8000', 'RGB888'], stdin=subprocess.PIPE)
+    parser = argparse.ArgumentParser(description='Sample feeder for clouddisplayencoder', conflict_handler='resolve')
+    parser.add_argument('--encoder', default='./clouddisplayencoder', metavar='PATH')
+    parser.add_argument('--images', default='images/*.jpeg', metavar='GLOB')
+    parser.add_argument('-w', default=1280, type=int, metavar='WIDTH')
+    parser.add_argument('-h', default=720, type=int, metavar='HEIGHT')
+    parser.add_argument('-f', '--fps', default=12.0, type=float)
+    parser.add_argument('-p', '--port', default='8000')
+    parser.add_argument('host')
 
-    for infile in glob.glob('images/*.jpeg'):
-        im = Image.open(infile)
-        ffmpeg.stdin.write(struct.pack('4sii', 'FRM\n', *im.size))
-        ffmpeg.stdin.write(im.tostring('raw', 'RGB'))
-        ffmpeg.stdin.flush()
-        time.sleep(5/60)
+    args = parser.parse_args()
+    if args.w % 2 or args.h % 2:
+        parser.error('WIDTH and HEIGHT must be even')
+
+    encoder = subprocess.Popen([args.encoder, args.host, args.port, str(args.w), str(args.h), 'RGB888'],
+                               stdin=subprocess.PIPE)
+
+    for infile in sorted(glob.glob(args.images)):
+        # Every frame must have the size given to the encoder.
+        im = Image.open(infile).convert('RGB').resize((args.w, args.h))
+        encoder.stdin.write(struct.pack('<4sQ', b'FRM\n', int(time.time() * 1000000)))
+        encoder.stdin.write(im.tobytes())
+        encoder.stdin.flush()
+        time.sleep(1.0 / args.fps)
+
+    encoder.stdin.close()
+    encoder.wait()
@@ -12,20 +12,56 @@ int _CRT_fmode = _O_BINARY;
 #include <unistd.h>
 #include <signal.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/cpu.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
 #include <libswresample/swresample.h>
-#include <libswscale/swscale.h>
+
+#include "colorconvert.h"
+#include "metrics.h"
+#include "spscqueue.h"
+#include "udpoutput.h"
 
 
 #define MAX_FDS_OPEN 512
 #define VIDEO_STREAM_ID 0
 #define AUDIO_STREAM_ID 1
 
+// Rows converted together when only part of the picture changed.
+#define CONVERSION_BAND_HEIGHT 16
+// Identical frames skipped in a row before one is encoded anyway, so
+// viewers joining a static screen still get a picture.
+#define MAX_SKIPPED_FRAMES 30
+// Macroblocks of `BLR\n`, a row of them per band.
+#define BLUR_BLOCK_SIZE CONVERSION_BAND_HEIGHT
+// Pixels around the cursor of `BLR\n` that are never filtered.
+#define BLUR_CURSOR_RADIUS 64
+// Strongest level of `BLR\n`, see `filter_blur_band()`.
+#define BLUR_MAX_LEVEL 2
+
+// Buffers in flight between the pipeline stages.
+#define VIDEO_JOB_COUNT 3
+#define VIDEO_FRAME_COUNT 3
+#define AUDIO_BUFFER_COUNT 8
+#define PACKET_QUEUE_SIZE 32
+
 #pragma pack(push)
 #pragma pack(1)
 
@@ -34,18 +70,282 @@ typedef struct {
   uint64_t pts;
 } CommandData;
 
+// Layout of the shared memory ring created by the capture process.
+// `slotState[i]` is set to 1 by the producer before ringing the `SHM\n`
+// doorbell for slot `i` and cleared by the encoder once it is done reading.
+typedef struct {
+  char magic[4]; // 'CDSM'
+  uint32_t slotCount;
+  uint32_t slotSize; // bytes per slot
+  uint32_t slotOffset; // offset of the first slot from the start of the ring
+  uint32_t slotState[];
+} ShmRingHeader;
+
+typedef struct {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+} DirtyRectData;
+
+typedef struct {
+  uint32_t rectCount;
+  int32_t cursorX; // negative without a cursor
+  int32_t cursorY;
+} BlurData;
+
+typedef struct {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  int32_t level;
+} BlurRectData;
+
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  char pixelFormat[16]; // PIX_FMT as on the command line, NUL padded
+} ConfigData;
+
+typedef struct {
+  char host[64]; // DEST_IP, NUL padded
+  uint16_t port;
+} DestinationData;
+
+// First command on a `-S` connection, the positional parameters.
+typedef struct {
+  DestinationData destination;
+  ConfigData config;
+  char audioFormat[16]; // AUD_FMT, NUL padded, empty without audio
+  uint32_t sampleRate;
+} SessionData;
+
 #pragma pack(pop)
 
 
-// Only invariants are allowed to be static.
-static int32_t inputWidth = 0;
-static int32_t inputHeight = 0;
-static enum AVPixelFormat inputPixelFormat = AV_PIX_FMT_NONE;
-static size_t inputBytesPerPixel = 0;
+// Geometry of the input pictures, from the command line until a `CFG\n`
+// or `STR\n` replaces it. Every stage keeps its own copy, changes travel in
+// order down the pipeline with the pictures.
+typedef struct {
+  int32_t width;
+  int32_t height;
+  enum AVPixelFormat pixelFormat;
+  size_t bytesPerPixel; // of the first plane
+  int32_t stride; // bytes from a row to the next, rows are packed unless `STR\n` pads them
+} InputFormat;
+
+
+typedef enum {
+  JOB_FRAME, // `FRM\n`, the picture is swapped into the converter
+  JOB_SHM_FRAME, // `SHM\n`, converted straight out of the ring slot
+  JOB_DIRTY_RECTS, // `DRT\n`, rectangle headers each followed by their pixels
+  JOB_CONFIG, // `CFG\n`, the blank picture is swapped in with its new format
+  JOB_STRIDE, // `STR\n`, the picture is copied into the job's and swapped in
+  JOB_BLUR, // `BLR\n`, a `BlurData` followed by its rectangles
+  JOB_END // End of input, drain the pipeline
+} VideoJobType;
+
+typedef struct {
+  VideoJobType type;
+  int64_t pts; // capture time in microseconds, from the command
+  int64_t deadline; // when the reader queued it, see `WorkerPool`
+  AVPicture picture;
+  InputFormat format; // of `picture`
+  uint32_t slot;
+  uint32_t rectCount;
+  uint8_t *rects;
+  size_t rectsSize;
+  size_t rectsCapacity;
+} VideoJob;
+
+// Horizontal slice of the picture, a whole number of bands converted by a
+// single worker at a time.
+typedef struct {
+  int firstBand;
+  int endBand;
+} ConversionSlice;
+
+typedef struct {
+  ConversionSlice *slices;
+  const InputFormat *input;
+  AVFrame *frame;
+  const AVPicture *picture;
+  const uint8_t *bands;
+  const int8_t *blurLevels; // level of every macroblock, see `BLR\n`
+  int blurColumns;
+} ConversionJob;
+
+// An `encode_picture()` call run on the shared pool.
+typedef struct {
+  AVCodecContext *encodingContext;
+  AVFrame *frame;
+  AVPacket *packet;
+  int ret;
+} EncodeJob;
+
+// Tasks of one `worker_pool_run()` call, queued on the pool until every
+// task has been taken.
+typedef struct WorkerBatch {
+  void (*run)(void *arg, int task);
+  void *arg;
+  int taskCount;
+  int nextTask;
+  int doneTasks;
+  int64_t deadline; // av_gettime() microseconds
+  pthread_cond_t done;
+  struct WorkerBatch *next;
+} WorkerBatch;
+
+// Persistent threads running batches of tasks, see `worker_pool_run()`.
+// Batches are served earliest deadline first, so a pool shared by several
+// sessions does not let one of them starve the others.
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  WorkerBatch *batches; // with tasks left, sorted by deadline
+  int callerHelps; // callers run tasks of their own batch too
+  int stop; // set by `worker_pool_destroy()`
+  pthread_t *threads;
+  int threadCount;
+} WorkerPool;
+
+typedef struct {
+  AVFrame *frame;
+  // Version of every band the frame was converted from. Frames are
+  // recycled, so only bands that changed since its last use are converted.
+  uint32_t *bandVersions;
+  // Input format the versions refer to, see `JOB_CONFIG`.
+  uint32_t configuration;
+  int keyframe; // first frame of a configuration, encoded as IDR
+  int64_t pts; // capture time of the job it was converted from
+  int64_t deadline; // of the same job
+} VideoFrame;
+
+// PCM of exactly one encoder frame, and when its first sample was captured.
+typedef struct {
+  uint8_t *data; // NULL ends the audio lane
+  int64_t pts; // microseconds
+} AudioBuffer;
+
+/**
+ * Stages of the pipeline and the queues between them. Each queue has
+ * exactly one producer and one consumer thread:
+ *
+ *   reader -> jobs -> converter -> frames -> encoder -> videoPackets -> sender
+ *   reader -> audio -> audio encoder -> audioPackets -> sender
+ *
+ * Buffers travel back to the producer through the matching `free` queue.
+**/
+typedef struct {
+  AVFormatContext *outputContext;
+  UdpOutput *udpOutput;
+  AVCodecContext *videoEncodingContext;
+  AVCodec *videoEncoder; // to reopen it when the geometry changes
+  AVCodecContext *aCodecCtx;
+  enum AVSampleFormat inputSampleFormat;
+  AVFrame *audioFrame; // owned by the audio encoder
+  SwrContext *resampler;
+
+  SpscQueue jobs;
+  SpscQueue freeJobs;
+  // Newest `FRM\n` not taken by the converter yet, newer than every queued
+  // job. A frame arriving before it is taken replaces it, see `post_frame()`.
+  pthread_mutex_t latestFrameMutex;
+  VideoJob *latestFrame;
+  sem_t jobsReady; // posted for every job queued or posted
+  SpscQueue frames;
+  SpscQueue freeFrames;
+  SpscQueue audio;
+  SpscQueue freeAudio;
+
+  sem_t packetsReady;
+  SpscQueue videoPackets;
+  SpscQueue audioPackets;
+
+  // Bitrate ceiling requested with `BRT\n`, written by the reader and
+  // applied by the encoder before its next frame.
+  uint32_t targetBitrate; // kbit/s
+} Pipeline;
 
-static enum AVSampleFormat inputSampleFormat = AV_SAMPLE_FMT_NONE;
-static size_t audioBytesPerSample = 0;
-static int inputSampleRate = 0;
+/**
+ * A pipeline and the reader feeding it. The command line describes the only
+ * session, unless `-S` hosts one per connection in the same process.
+**/
+typedef struct {
+  FILE *input;
+  Pipeline pipeline;
+  pthread_t converter;
+  pthread_t encoder;
+  pthread_t audioEncoder;
+  pthread_t sender;
+
+  // Only used by the reader.
+  InputFormat format;
+  VideoJob *spareJob; // replaced in `latestFrame` or left over, used before `freeJobs`
+  size_t audioBytesPerSample;
+  size_t audioSamplesMax;
+  int sampleRate;
+  AudioBuffer audioBuffer;
+  size_t audioSamples;
+} Session;
+
+
+// Only invariants and statistics are allowed to be static.
+
+// Pool shared by every session with `-S`, NULL when there is only one.
+static WorkerPool *sharedPool = NULL;
+
+// Optional shared memory ring, mapped once at startup.
+static ShmRingHeader *shmRing = NULL;
+static size_t shmRingSize = 0;
+
+// Frames between intra refreshes, 0 for intra only encoding.
+static int refreshPeriod = 0;
+
+// Nominal capture rate. Timestamps are capture times, but x264 budgets
+// the bits of every frame, and sizes the VBV, from this rate.
+static int frameRate = 15;
+
+// Slices converted in parallel, 0 for one per CPU.
+static int conversionSlices = 0;
+
+// VBV constraints in kbit/s and kbit, 0 for unconstrained CRF.
+static int maxBitrate = 0;
+static int vbvBufferSize = 0;
+static int constantBitrate = 0;
+
+// Microseconds the datagrams of a packet are spread over, 0 to send at once.
+static int64_t pacingInterval = 0;
+
+// Frames are queued instead of replaced by newer ones when the encoder
+// falls behind, see `post_frame()`.
+static int keepAllFrames = 0;
+
+// Audio is encoded with Opus frames of `opusFrameDuration` milliseconds
+// instead of AAC, whose 1024 sample frames are buffered for over 20 ms.
+static int opusAudio = 0;
+static const char *opusFrameDuration = "10";
+
+// Stage timings written by `-M`, registered by `register_metrics()`.
+static struct {
+  MetricsHistogram *read; // pixels of a video command
+  MetricsHistogram *convert;
+  MetricsHistogram *encode;
+  MetricsHistogram *send;
+  MetricsCounter *framesEncoded;
+  MetricsCounter *framesSkipped;
+  MetricsCounter *framesDropped;
+} metrics;
+
+// Summed over every session.
+static struct {
+  uint64_t framesEncoded;
+  uint64_t framesSkipped; // identical to the previous one
+  uint64_t framesDropped; // replaced by a newer one before being encoded
+  uint64_t bytesEncoded;
+  int64_t encodeTime; // microseconds spent in the video encoder
+} encoderStats;
 
 
 // Doing this in 2014 seems backwards
@@ -61,6 +361,108 @@ static void sigterm_handler(int sig) {
 }
 
 
+static void print_stats(void) {
+  uint64_t framesEncoded = __atomic_load_n(&encoderStats.framesEncoded, __ATOMIC_RELAXED);
+  uint64_t framesSkipped = __atomic_load_n(&encoderStats.framesSkipped, __ATOMIC_RELAXED);
+  uint64_t framesDropped = __atomic_load_n(&encoderStats.framesDropped, __ATOMIC_RELAXED);
+  uint64_t bytesEncoded = __atomic_load_n(&encoderStats.bytesEncoded, __ATOMIC_RELAXED);
+  int64_t encodeTime = __atomic_load_n(&encoderStats.encodeTime, __ATOMIC_RELAXED);
+  fprintf(stderr, "encoded %llu frames, skipped %llu identical frames, dropped %llu stale frames\n",
+          (unsigned long long)framesEncoded, (unsigned long long)framesSkipped,
+          (unsigned long long)framesDropped);
+  if (framesEncoded > 0) {
+    fprintf(stderr, "%.0f bytes per frame, %.2f ms encoding per frame\n",
+            (double)bytesEncoded / framesEncoded, encodeTime / 1000.0 / framesEncoded);
+  }
+  udp_output_print_stats();
+}
+
+
+static void register_metrics(void) {
+  metrics.read = metrics_histogram("read");
+  metrics.convert = metrics_histogram("convert");
+  metrics.encode = metrics_histogram("encode");
+  metrics.send = metrics_histogram("send");
+  metrics.framesEncoded = metrics_counter("frames_encoded");
+  metrics.framesSkipped = metrics_counter("frames_skipped");
+  metrics.framesDropped = metrics_counter("frames_dropped");
+}
+
+
+static void usage(const char *program) __attribute__ ((noreturn));
+static void usage(const char *program) {
+  fprintf(stderr, "%s [-m SHM_NAME] [-g REFRESH_PERIOD] [-r FPS] [-s SLICES] [-b MAX_KBPS [-B VBV_KBITS] [-c]] [-p PACING_US] [-K] [-A aac|opus[:FRAME_MS]] [-M STATS_FILE] [-d DEST_IP:DEST_PORT]... DEST_IP DEST_PORT WIDTH HEIGHT PIX_FMT [AUD_FMT SAMPLE_RATE]\n", program);
+  fprintf(stderr, "%s -S SOCKET_PATH [-g REFRESH_PERIOD] [-r FPS] [-s SLICES] [-b MAX_KBPS [-B VBV_KBITS] [-c]] [-p PACING_US] [-K] [-A aac|opus[:FRAME_MS]] [-M STATS_FILE]\n", program);
+  exit(1);
+}
+
+
+static void shm_ring_check(size_t pictureSize) {
+  if (shmRing->slotSize < pictureSize) {
+    fprintf(stderr, "shared memory slots are too small: %u < %zu\n",
+            shmRing->slotSize, pictureSize);
+    exit(1);
+  }
+}
+
+
+static void shm_ring_open(const char *name, size_t pictureSize) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    perror("unable to open shared memory ring");
+    exit(1);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("unable to stat shared memory ring");
+    exit(1);
+  }
+
+  shmRingSize = (size_t)st.st_size;
+  void *base = mmap(NULL, shmRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the object alive.
+  if (base == MAP_FAILED) {
+    perror("unable to map shared memory ring");
+    exit(1);
+  }
+  shmRing = base;
+
+  if (shmRingSize < sizeof(ShmRingHeader) ||
+      memcmp(shmRing->magic, "CDSM", 4) != 0 ||
+      // The converter holds on to the last slot, a single one would
+      // leave the producer waiting for it forever.
+      shmRing->slotCount < 2 ||
+      shmRing->slotOffset < sizeof(ShmRingHeader) + shmRing->slotCount * sizeof(uint32_t) ||
+      shmRing->slotOffset + (size_t)shmRing->slotCount * shmRing->slotSize > shmRingSize) {
+    fprintf(stderr, "invalid shared memory ring: %s\n", name);
+    exit(1);
+  }
+
+  shm_ring_check(pictureSize);
+}
+
+
+static uint8_t *shm_ring_slot(uint32_t slot) {
+  return (uint8_t *)shmRing + shmRing->slotOffset + (size_t)slot * shmRing->slotSize;
+}
+
+
+/**
+ * Whether the producer published `slot`. Pairs with the producer's release
+ * store, so the slot data is visible once this returns 1.
+**/
+static int shm_ring_published(uint32_t slot) {
+  return __atomic_load_n(&shmRing->slotState[slot], __ATOMIC_ACQUIRE) == 1;
+}
+
+
+static void shm_ring_release(uint32_t slot) {
+  // Let the producer reuse the slot. Pairs with the producer's acquire load.
+  __atomic_store_n(&shmRing->slotState[slot], 0, __ATOMIC_RELEASE);
+}
+
+
 static size_t aud_fmt_to_bytes_per_sample(const char* aud_fmt) {
   if (strcmp(aud_fmt, "PCMS16LE") == 0) {
     return 4; // Two bytes times two channels
@@ -80,12 +482,19 @@ static enum AVSampleFormat aud_fmt_str_to_enum(const char* aud_fmt) {
     return AV_SAMPLE_FMT_FLT;
   } else {
     printf("Error! Invalid AUD_FMT: %s\n", aud_fmt);
-    exit(1);
+    return AV_SAMPLE_FMT_NONE;
   }
 }
 
 
 static size_t pix_fmt_to_bytes_per_pixel(const char* pix_fmt) {
+  // Luma samples of the YUV formats.
+  if (strcmp(pix_fmt, "I420") == 0 || strcmp(pix_fmt, "NV12") == 0) {
+    return 1;
+  } else if (strcmp(pix_fmt, "YUYV422") == 0) {
+    return 2;
+  }
+
   // Count the number of '8' in pix_fmt.
   size_t result = 0;
   size_t len = strlen(pix_fmt);
@@ -109,24 +518,29 @@ static enum AVPixelFormat pix_fmt_str_to_enum(const char* pix_fmt) {
     return AV_PIX_FMT_BGRA;
   } else if (strcmp(pix_fmt, "RGBA8888") == 0) {
     return AV_PIX_FMT_RGBA;
+  } else if (strcmp(pix_fmt, "I420") == 0) {
+    return AV_PIX_FMT_YUV420P;
+  } else if (strcmp(pix_fmt, "NV12") == 0) {
+    return AV_PIX_FMT_NV12;
+  } else if (strcmp(pix_fmt, "YUYV422") == 0) {
+    return AV_PIX_FMT_YUYV422;
   } else {
     printf("Error! Invalid PIX_FMT: %s\n", pix_fmt);
-    exit(1);
+    return AV_PIX_FMT_NONE;
   }
 }
 
 /**
  * `buffer` must contain exactly `aCodecCtx->frame_size` samples.
 **/
-static int encode_audio(AVCodecContext *aCodecCtx,
-                        uint8_t *buffer,
+static int encode_audio(Pipeline *pipeline,
+                        const AudioBuffer *buffer,
                         AVPacket *packet) {
-  static AVFrame *frame = NULL;
-  static SwrContext *swrCtx = NULL;
+  AVCodecContext *aCodecCtx = pipeline->aCodecCtx;
 
-  if (!frame) {
+  if (!pipeline->audioFrame) {
     // AAC requires exactly 1024 samples from each channel.
-    frame = avcodec_alloc_frame();
+    AVFrame *frame = avcodec_alloc_frame();
     if (!frame) {
       fprintf(stderr, "Could not allocate audio frame\n");
       exit(1);
@@ -146,14 +560,16 @@ static int encode_audio(AVCodecContext *aCodecCtx,
       fprintf(stderr, "Could not setup audio frame\n");
       exit(1);
     }
+    pipeline->audioFrame = frame;
   }
+  AVFrame *frame = pipeline->audioFrame;
 
-  if (!swrCtx) {
+  if (!pipeline->resampler) {
     // We need to resample from whatever the user is sending us to
-    swrCtx = swr_alloc();
+    SwrContext *swrCtx = swr_alloc();
 
     av_opt_set_int(swrCtx, "in_channel_layout", (int64_t)aCodecCtx->channel_layout, 0);
-    av_opt_set_int(swrCtx, "in_sample_fmt", inputSampleFormat, 0);
+    av_opt_set_int(swrCtx, "in_sample_fmt", pipeline->inputSampleFormat, 0);
     av_opt_set_int(swrCtx, "in_sample_rate", aCodecCtx->sample_rate, 0);
 
     av_opt_set_int(swrCtx, "out_channel_layout", (int64_t)aCodecCtx->channel_layout, 0);
@@ -164,15 +580,16 @@ static int encode_audio(AVCodecContext *aCodecCtx,
       fprintf(stderr, "Unsupported resampler!\n");
       exit(1);
     }
+    pipeline->resampler = swrCtx;
   }
 
-  if (swr_convert(swrCtx, frame->extended_data, aCodecCtx->frame_size,
-      (const uint8_t**)&buffer, aCodecCtx->frame_size) < 0) {
+  if (swr_convert(pipeline->resampler, frame->extended_data, aCodecCtx->frame_size,
+      (const uint8_t**)&buffer->data, aCodecCtx->frame_size) < 0) {
     fprintf(stderr, "unable to rescale image\n");
     exit(1);
   }
 
-  frame->pts = av_gettime();
+  frame->pts = buffer->pts;
 
   // Encode the image
   int got_packet = 0;
@@ -188,278 +605,2142 @@ static int encode_audio(AVCodecContext *aCodecCtx,
 }
 
 
+static AVFrame *alloc_video_frame(int width, int height) {
+  AVFrame *frame = avcodec_alloc_frame();
+  if (!frame) {
+    fprintf(stderr, "error allocating video frame\n");
+    exit(1);
+  }
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width  = width;
+  frame->height = height;
+
+  // The image can be allocated by any means and av_image_alloc()
+  // is just the most convenient way if av_malloc() is to be used.
+  if (av_image_alloc(frame->data, frame->linesize, frame->width,
+                     frame->height, frame->format, 32) < 0) {
+    fprintf(stderr, "error allocation video frame data\n");
+    exit(1);
+  }
+  return frame;
+}
+
+
+static void free_video_frame(AVFrame *frame) {
+  av_freep(&frame->data[0]);
+  avcodec_free_frame(&frame);
+}
+
+
 /**
-  If function returns 0 it is up to the caller to free the packet.
+ * Rows of `plane` covering `rows` picture rows, chroma planes of I420 and
+ * NV12 have half as many.
 **/
-static int encode_picture(AVCodecContext *encodingContext,
-                          AVPicture *picture,
-                          AVPacket *packet) {
-  static struct AVFrame *frame = NULL;
-  static struct SwsContext *sws_ctx = NULL;
+static int input_plane_rows(const InputFormat *format, int plane, int rows) {
+  return plane == 0 ? rows : rows >> av_pix_fmt_desc_get(format->pixelFormat)->log2_chroma_h;
+}
 
-  if (!frame) {
-    frame = avcodec_alloc_frame();
-    if (!frame) {
-      fprintf(stderr, "error allocating video frame\n");
-      exit(1);
-    }
-    frame->format = encodingContext->pix_fmt;
-    frame->width  = encodingContext->width;
-    frame->height = encodingContext->height;
 
-    // The image can be allocated by any means and av_image_alloc()
-    // is just the most convenient way if av_malloc() is to be used.
-    if (av_image_alloc(frame->data, frame->linesize, frame->width,
-                       frame->height, frame->format, 32) < 0) {
-      fprintf(stderr, "error allocation video frame data\n");
-      exit(1);
-    }
+/**
+ * Fills `linesizes` for the planes of `format` and returns their count.
+ * Chroma rows are padded in proportion to the luma rows, so that an I420
+ * `stride` gives chroma rows half of it.
+**/
+static int input_linesizes(const InputFormat *format, int linesizes[4]) {
+  if (av_image_fill_linesizes(linesizes, format->pixelFormat, format->width) < 0) {
+    fprintf(stderr, "unable to lay out input picture\n");
+    exit(1);
   }
-
-  if (!sws_ctx) {
-    sws_ctx = sws_getContext(inputWidth, inputHeight, inputPixelFormat,
-                             frame->width, frame->height, frame->format,
-                             SWS_BICUBIC, NULL, NULL, NULL);
-    if (!sws_ctx) {
-      fprintf(stderr, "Could not initialize the conversion context\n");
-      exit(1);
-    }
+  int rowSize = linesizes[0];
+  int planes = 0;
+  for (; planes < 4 && linesizes[planes]; ++planes) {
+    linesizes[planes] = (int)((int64_t)linesizes[planes] * format->stride / rowSize);
   }
+  return planes;
+}
 
-  if (sws_scale(sws_ctx, (const uint8_t * const *)picture->data, picture->linesize,
-                0, inputHeight, frame->data, frame->linesize) <= 0) {
-    fprintf(stderr, "unable to rescale image\n");
-    exit(1);
+
+static size_t input_picture_size(const InputFormat *format) {
+  int linesizes[4];
+  int planes = input_linesizes(format, linesizes);
+  size_t size = 0;
+  for (int plane = 0; plane < planes; ++plane) {
+    size += (size_t)linesizes[plane] * (size_t)input_plane_rows(format, plane, format->height);
   }
+  return size;
+}
 
-  frame->pts = av_gettime();
 
-  // Encode the image
-  int got_packet = 0;
-  if (avcodec_encode_video2(encodingContext, packet, frame, &got_packet) < 0) {
-    fprintf(stderr, "error encoding video frame\n");
-    return -1;
-  } else if (got_packet && packet->size) {
-    packet->stream_index = VIDEO_STREAM_ID;
-    return 0;
-  } else {
-    return 1;
+/**
+ * Points `picture` at the planes of a picture of `format` stored at `data`,
+ * one plane after the other like `FRM\n` and `SHM\n` send them.
+**/
+static void fill_input_planes(AVPicture *picture, uint8_t *data, const InputFormat *format) {
+  memset(picture, 0, sizeof(AVPicture));
+  int planes = input_linesizes(format, picture->linesize);
+  for (int plane = 0; plane < planes; ++plane) {
+    picture->data[plane] = data;
+    data += (size_t)picture->linesize[plane] * (size_t)input_plane_rows(format, plane, format->height);
   }
 }
 
 
-static void send_packet(AVFormatContext *outputContext, AVPacket* packet) {
-  // Write the compressed frame to the media output
-  int err = av_write_frame(outputContext, packet);
-  if (err < 0) {
-    fprintf(stderr, "unable to write frame: %s\n", av_err2str(err));
-    return;
+/**
+ * Allocates `picture` for `format` with the rows `format->stride` apart,
+ * matching the `FRM\n` data read straight into it.
+**/
+static void alloc_input_picture(AVPicture *picture, const InputFormat *format) {
+  uint8_t *data = av_malloc(input_picture_size(format));
+  if (!data) {
+    fprintf(stderr, "error allocating input picture\n");
+    exit(1);
   }
+  fill_input_planes(picture, data, format);
+}
 
-  // Force flushing the output context
-  av_write_frame(outputContext, NULL);
 
-  // Free packet allocated by decoding.
-  av_free_packet(packet);
+/**
+ * Paints `picture` black, which is not all zeros for the YUV formats.
+**/
+static void clear_input_picture(AVPicture *picture, const InputFormat *format) {
+  if (av_pix_fmt_desc_get(format->pixelFormat)->flags & AV_PIX_FMT_FLAG_RGB) {
+    memset(picture->data[0], 0, input_picture_size(format));
+  } else if (format->pixelFormat == AV_PIX_FMT_YUYV422) {
+    for (int row = 0; row < format->height; ++row) {
+      uint8_t *pixel = picture->data[0] + row * picture->linesize[0];
+      for (int x = 0; x < format->width; ++x) {
+        pixel[2 * x] = 16;
+        pixel[2 * x + 1] = 128;
+      }
+    }
+  } else {
+    int linesizes[4];
+    int planes = input_linesizes(format, linesizes);
+    for (int plane = 0; plane < planes; ++plane) {
+      memset(picture->data[plane], plane == 0 ? 16 : 128,
+             (size_t)linesizes[plane] * (size_t)input_plane_rows(format, plane, format->height));
+    }
+  }
 }
 
 
-int main(int argc, char const *argv[]) {
-  // Check for parameters
-  if (argc < 6) {
-    fprintf(stderr, "%s DEST_IP DEST_PORT WIDTH HEIGHT PIX_FMT\n", argv[0]);
-    return 1;
+/**
+ * Points `src` at row `firstRow` of every plane of `picture`.
+**/
+static void input_rows(const InputFormat *input, const AVPicture *picture, int firstRow,
+                       const uint8_t *src[4]) {
+  for (int plane = 0; plane < 4; ++plane) {
+    src[plane] = picture->data[plane]
+        ? picture->data[plane] + input_plane_rows(input, plane, firstRow) * picture->linesize[plane]
+        : NULL;
   }
+}
 
-  // Close all file descriptors except the standard ones
-  // This avoids conflitcs between parent context and this one.
-  for (int i = STDERR_FILENO + 1; i < MAX_FDS_OPEN; ++i) {
-    close(i);
-  }
 
-  // Register a few signals to avoid blocking forever.
-  signal(SIGINT, sigterm_handler);
-  signal(SIGTERM, sigterm_handler);
+/**
+ * Converts `rows` rows of `picture` starting at `firstRow` into `frame`,
+ * the YUV420P frame of the same size.
+ * `firstRow` and `rows` must be even so chroma rows are not split.
+**/
+static void convert_rows(const InputFormat *input, AVFrame *frame, const AVPicture *picture,
+                         int firstRow, int rows) {
+  uint8_t *dst[3] = {
+    frame->data[0] + firstRow * frame->linesize[0],
+    frame->data[1] + firstRow / 2 * frame->linesize[1],
+    frame->data[2] + firstRow / 2 * frame->linesize[2]
+  };
+  if (color_convert_supported(input->pixelFormat)) {
+    color_convert_yuv420p(input->pixelFormat, input->width, rows,
+                          picture->data[0] + firstRow * picture->linesize[0],
+                          picture->linesize[0], dst, frame->linesize);
+  } else if (color_repack_supported(input->pixelFormat)) {
+    const uint8_t *src[4];
+    input_rows(input, picture, firstRow, src);
+    color_repack_yuv420p(input->pixelFormat, input->width, rows, src,
+                         picture->linesize, dst, frame->linesize);
+  } else {
+    // Every PIX_FMT of `pix_fmt_str_to_enum()` has a kernel.
+    fprintf(stderr, "unsupported pixel format: %s\n", av_get_pix_fmt_name(input->pixelFormat));
+    exit(1);
+  }
+}
 
-  // Initialize global parameters
-  char outputAddr[256] = {0};
-  snprintf(outputAddr, sizeof(outputAddr), "udp://%s:%s", argv[1], argv[2]);
-  inputWidth = atoi(argv[3]);
-  inputHeight = atoi(argv[4]);
-  inputPixelFormat = pix_fmt_str_to_enum(argv[5]);
-  inputBytesPerPixel = pix_fmt_to_bytes_per_pixel(argv[5]);
 
-  if (argc == 8) {
-    inputSampleFormat = aud_fmt_str_to_enum(argv[6]);
-    audioBytesPerSample = aud_fmt_to_bytes_per_sample(argv[6]);
-    inputSampleRate = atoi(argv[7]);
+/**
+ * Takes the next task of the first batch, unqueuing the batch once its
+ * last task is taken. Called with the pool mutex held.
+**/
+static int worker_pool_take(WorkerPool *pool, WorkerBatch *batch) {
+  int task = batch->nextTask++;
+  if (batch->nextTask == batch->taskCount) {
+    WorkerBatch **link = &pool->batches;
+    while (*link != batch) link = &(*link)->next;
+    *link = batch->next;
   }
+  return task;
+}
 
-  // Register all formats and codecs
-  av_register_all();
-  avformat_network_init();
 
-  // Alloc context for outputting the data.
-  AVFormatContext *outputContext = NULL;
-  avformat_alloc_output_context2(&outputContext, NULL, "mpegts", outputAddr);
-  if (!outputContext) {
-    fprintf(stderr, "error allocating output context\n");
-    return 1;
+/**
+ * Runs `run(arg, task)` for every task in `[0, taskCount)` on the pool and
+ * returns once all of them are done. The calling thread takes part unless
+ * the pool is shared, see `WorkerPool.callerHelps`.
+**/
+static void worker_pool_run(WorkerPool *pool, void (*run)(void *, int),
+                            void *arg, int taskCount, int64_t deadline) {
+  WorkerBatch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.run = run;
+  batch.arg = arg;
+  batch.taskCount = taskCount;
+  batch.deadline = deadline;
+  pthread_cond_init(&batch.done, NULL);
+
+  pthread_mutex_lock(&pool->mutex);
+  // Equal deadlines keep their arrival order.
+  WorkerBatch **link = &pool->batches;
+  while (*link && (*link)->deadline <= deadline) link = &(*link)->next;
+  batch.next = *link;
+  *link = &batch;
+  pthread_cond_broadcast(&pool->wake);
+
+  while (pool->callerHelps && batch.nextTask < batch.taskCount) {
+    int task = worker_pool_take(pool, &batch);
+    pthread_mutex_unlock(&pool->mutex);
+    run(arg, task);
+    pthread_mutex_lock(&pool->mutex);
+    ++batch.doneTasks;
   }
 
-  // Find the H.264 encoder. The `encoder` struct must be "opened" before using.
-  AVCodec *videoEncoder = avcodec_find_encoder_by_name("libx264");
-  if (!videoEncoder) {
-    fprintf(stderr, "x264 encoder not found\n");
-    return 1;
+  while (batch.doneTasks < batch.taskCount) {
+    pthread_cond_wait(&batch.done, &pool->mutex);
   }
+  pthread_mutex_unlock(&pool->mutex);
+  pthread_cond_destroy(&batch.done);
+}
 
-  // Add the video stream to the output. This stream will contain video frames.
-  AVStream *videoStream = avformat_new_stream(outputContext, videoEncoder);
-  if (!videoStream) {
-    fprintf(stderr, "error when creating videoStream\n");
-    return 1;
-  }
-  // Configure the stream ID (needed for transmitting it)
-  videoStream->id = VIDEO_STREAM_ID;
 
-  // Grab the encoding context from format.
-  AVCodecContext *videoEncodingContext = videoStream->codec;
+static void *worker_thread(void *arg) {
+  WorkerPool *pool = arg;
 
-  // Resolution must be a multiple of two
-  videoEncodingContext->width = inputWidth;
-  videoEncodingContext->height = inputHeight;
-  // Set default encoding parameters
-  videoEncodingContext->time_base.num = 1;
-  videoEncodingContext->time_base.den = 15;
-  videoEncodingContext->gop_size = 0; // Emit only intra frames
-  videoEncodingContext->has_b_frames = 0; // We don't want b frames
-  videoEncodingContext->me_method = 1; // No motion estimation
-  videoEncodingContext->pix_fmt = AV_PIX_FMT_YUV420P;
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (!pool->batches && !pool->stop) {
+      pthread_cond_wait(&pool->wake, &pool->mutex);
+    }
+    if (pool->stop) break;
 
-  // Set the same presets as in the command line
-  av_opt_set(videoEncodingContext->priv_data, "preset", "ultrafast", 0);
-  av_opt_set(videoEncodingContext->priv_data, "tune", "zerolatency", 0);
-  av_opt_set_double(videoEncodingContext->priv_data, "crf", 20.0, 0);
+    WorkerBatch *batch = pool->batches;
+    int task = worker_pool_take(pool, batch);
+    pthread_mutex_unlock(&pool->mutex);
+    batch->run(batch->arg, task);
+    pthread_mutex_lock(&pool->mutex);
 
-  // Open encoding context for our encoder
-  if (avcodec_open2(videoEncodingContext, videoEncoder, NULL) < 0) {
-    fprintf(stderr, "error opening encoder\n");
-    return 1;
+    if (++batch->doneTasks == batch->taskCount) {
+      pthread_cond_signal(&batch->done);
+    }
   }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
 
-  AVCodecContext *aCodecCtx = NULL;
-  uint8_t *audioBuffer = NULL;
-  size_t audioSamples = 0;
-  size_t audioSamplesMax = 0;
-  if (inputSampleFormat != AV_SAMPLE_FMT_NONE) {
-    // Find the AAC encoder. The `encoder` struct must be "opened" before using.
-    AVCodec *audioEncoder = avcodec_find_encoder_by_name("libfaac");
-    if (!audioEncoder) {
-      fprintf(stderr, "AAC encoder not found\n");
-      return 1;
-    }
 
-    // Add the audio stream to the output. This stream will contain audio frames.
-    AVStream *audioStream = avformat_new_stream(outputContext, audioEncoder);
-    if (!audioStream) {
-      fprintf(stderr, "error when creating videoStream\n");
-      return 1;
+static void worker_pool_init(WorkerPool *pool, int threadCount, int callerHelps) {
+  memset(pool, 0, sizeof(WorkerPool));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->callerHelps = callerHelps;
+
+  pool->threads = calloc((size_t)threadCount + 1, sizeof(pthread_t));
+  pool->threadCount = threadCount;
+  for (int i = 0; i < threadCount; ++i) {
+    int err = pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+    if (err != 0) {
+      fprintf(stderr, "unable to start worker thread: %s\n", strerror(err));
+      exit(1);
     }
-    // Configure the stream ID (needed for transmitting it)
-    audioStream->id = AUDIO_STREAM_ID;
+  }
+}
 
-    // Grab the encoding context from format.
-    aCodecCtx = audioStream->codec;
 
-    aCodecCtx->sample_fmt = audioEncoder->sample_fmts[0];
-    aCodecCtx->bit_rate = 128000;
-    aCodecCtx->sample_rate = inputSampleRate;
-    aCodecCtx->channels = av_get_channel_layout_nb_channels(AV_CH_LAYOUT_STEREO);
-    aCodecCtx->channel_layout = AV_CH_LAYOUT_STEREO;
+/**
+ * Stops and joins the workers, the pool may live on the stack of its owner.
+**/
+static void worker_pool_destroy(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->threadCount; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->wake);
+}
 
-    // Open encoding context for our encoder
-    if (avcodec_open2(aCodecCtx, audioEncoder, NULL) < 0) {
-      fprintf(stderr, "error opening encoder\n");
-      return 1;
-    }
 
-    audioSamplesMax = (size_t)aCodecCtx->frame_size;
-    audioBuffer = malloc(audioBytesPerSample * audioSamplesMax);
+/**
+ * 64-bit hash of `len` bytes, only used to tell whether a band changed.
+ * Four multiply-accumulate lanes are fed 32 bytes at a time, keyed by
+ * position so that moving content around still changes the hash.
+**/
+static uint64_t hash_bytes(const uint8_t *data, size_t len) {
+  static const uint64_t prime = 0x9E3779B185EBCA87ULL;
+  uint64_t lanes[4] = {
+    0x60EA27EEADC0B5D6ULL, 0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+  };
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128i acc0 = _mm_loadu_si128((const __m128i *)&lanes[0]);
+  __m128i acc1 = _mm_loadu_si128((const __m128i *)&lanes[2]);
+  __m128i key0 = _mm_set_epi64x(0x1CAD21F72C81017CLL, 0xBE4BA423396CFEB8LL);
+  __m128i key1 = _mm_set_epi64x(0xDB979083E96DD4DELL, 0x1F67B3B7A4A44072LL);
+  const __m128i step = _mm_set1_epi64x((long long)prime);
+
+  for (; i + 32 <= len; i += 32) {
+    __m128i d0 = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i d1 = _mm_loadu_si128((const __m128i *)(data + i + 16));
+    __m128i k0 = _mm_xor_si128(d0, key0);
+    __m128i k1 = _mm_xor_si128(d1, key1);
+    // acc += lo32(k) * hi32(k) + d
+    acc0 = _mm_add_epi64(acc0, _mm_add_epi64(_mm_mul_epu32(k0, _mm_srli_epi64(k0, 32)), d0));
+    acc1 = _mm_add_epi64(acc1, _mm_add_epi64(_mm_mul_epu32(k1, _mm_srli_epi64(k1, 32)), d1));
+    key0 = _mm_add_epi64(key0, step);
+    key1 = _mm_add_epi64(key1, step);
   }
 
-  // Open output buffer. This will also open the UDP socket.
-  if (avio_open(&outputContext->pb, outputAddr, AVIO_FLAG_WRITE) < 0) {
-    fprintf(stderr, "error opening output buffer\n");
-    return 1;
+  _mm_storeu_si128((__m128i *)&lanes[0], acc0);
+  _mm_storeu_si128((__m128i *)&lanes[2], acc1);
+#else
+  uint64_t keys[4] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL,
+    0x1F67B3B7A4A44072ULL, 0xDB979083E96DD4DEULL
+  };
+
+  for (; i + 32 <= len; i += 32) {
+    for (int lane = 0; lane < 4; ++lane) {
+      uint64_t d;
+      memcpy(&d, data + i + lane * 8, sizeof(d));
+      uint64_t k = d ^ keys[lane];
+      lanes[lane] += (k & 0xFFFFFFFFULL) * (k >> 32) + d;
+      keys[lane] += prime;
+    }
   }
+#endif
 
-  // Write transport stream header (PAT, PMT, etc).
-  // This segfaults without avio_open.
-  if (avformat_write_header(outputContext, NULL) < 0) {
-    fprintf(stderr, "error writing mpegts header\n");
-    return 1;
+  uint64_t hash = len * prime;
+  for (int lane = 0; lane < 4; ++lane) {
+    hash = (hash ^ lanes[lane]) * prime;
+    hash ^= hash >> 31;
   }
-
-  // Allocate picture so it can be correcly aligned.
-  AVPicture *inputPicture = calloc(1, sizeof(AVPicture));
-  if (av_image_alloc(inputPicture->data, inputPicture->linesize,
-                     inputWidth, inputHeight, inputPixelFormat, 32) < 0) {
-    fprintf(stderr, "error allocating input picture\n");
-    return 1;
+  for (; i < len; ++i) {
+    hash = (hash ^ data[i]) * prime;
   }
+  hash ^= hash >> 29;
+  return hash;
+}
 
-  // Our main loop. Moved here for clarity.
-  while (1) {
-    CommandData header;
-    memset(&header, 0, sizeof(header));
 
-    if (fread(&header, sizeof(header), 1, stdin) == 1) {
-      if (strncmp(header.command, "FRM\n", 4) == 0) {
-        size_t pictureSize = (size_t)(inputWidth * inputHeight) * inputBytesPerPixel;
-        if (fread(inputPicture->data[0], 1, pictureSize, stdin) == pictureSize) {
-          AVPacket packet;
-          memset(&packet, 0, sizeof(packet));
-          if (encode_picture(videoEncodingContext, inputPicture, &packet) == 0) {
-            send_packet(outputContext, &packet);
-          }
-        } else {
-          perror("unable to read frame");
-          exit(1);
+/**
+ * Hashes the bands flagged in `bands` and clears the flag of the ones
+ * whose contents did not change since they were last hashed.
+ * Returns the number of bands left flagged.
+**/
+static int refresh_bands(const InputFormat *input, const AVPicture *picture,
+                         uint64_t *bandHashes, uint8_t *bands, int bandCount) {
+  // Bytes of pixels in a row of each plane.
+  int rowSizes[4];
+  av_image_fill_linesizes(rowSizes, input->pixelFormat, input->width);
+  int planes = av_pix_fmt_count_planes(input->pixelFormat);
+  int changed = 0;
+  for (int band = 0; band < bandCount; ++band) {
+    if (!bands[band]) continue;
+
+    int firstRow = band * CONVERSION_BAND_HEIGHT;
+    int rows = (int)umin(CONVERSION_BAND_HEIGHT, (size_t)(input->height - firstRow));
+    const uint8_t *src[4];
+    input_rows(input, picture, firstRow, src);
+    uint64_t hash = 0;
+    for (int plane = 0; plane < planes; ++plane) {
+      int planeRows = input_plane_rows(input, plane, rows);
+      if (picture->linesize[plane] == rowSizes[plane]) {
+        hash = hash * 0x9E3779B185EBCA87ULL +
+               hash_bytes(src[plane], (size_t)planeRows * (size_t)rowSizes[plane]);
+      } else {
+        // Padding may hold anything, only the pixels count.
+        for (int row = 0; row < planeRows; ++row) {
+          hash = hash * 0x9E3779B185EBCA87ULL +
+                 hash_bytes(src[plane] + row * picture->linesize[plane], (size_t)rowSizes[plane]);
         }
-      } else if (strncmp(header.command, "AUD\n", 4) == 0) {
-        uint32_t inputSamples = 0;
-        if (fread(&inputSamples, sizeof(inputSamples), 1, stdin) == 1) {
-          while (inputSamples > 0) {
-            size_t samples = umin(inputSamples, audioSamplesMax - audioSamples);
-            if (fread((uint8_t *)audioBuffer + (audioSamples * audioBytesPerSample),
-                audioBytesPerSample, samples, stdin) == samples) {
-              inputSamples -= samples;
-              audioSamples += samples;
-              if (audioSamples == audioSamplesMax) {
-                AVPacket packet;
-                memset(&packet, 0, sizeof(packet));
-                if (encode_audio(aCodecCtx, audioBuffer, &packet) == 0) {
-                  send_packet(outputContext, &packet);
-                }
-                audioSamples = 0;
-              }
-            } else {
-              perror("unable to read audio data info");
-              exit(1);
-            }
+      }
+    }
+    if (hash == bandHashes[band]) {
+      bands[band] = 0;
+    } else {
+      bandHashes[band] = hash;
+      ++changed;
+    }
+  }
+  return changed;
+}
+
+
+/**
+ * Replaces every `size`x`size` block of the `width`x`height` area of
+ * `plane` at `x0`,`y0` by its average, clipping the blocks to the area.
+**/
+static void average_blocks(uint8_t *plane, int linesize, int x0, int y0,
+                           int width, int height, int size) {
+  for (int y = y0; y < y0 + height; y += size) {
+    int blockHeight = (int)umin((size_t)size, (size_t)(y0 + height - y));
+    for (int x = x0; x < x0 + width; x += size) {
+      int blockWidth = (int)umin((size_t)size, (size_t)(x0 + width - x));
+      int count = blockWidth * blockHeight;
+      int sum = 0;
+      for (int row = y; row < y + blockHeight; ++row) {
+        for (int column = x; column < x + blockWidth; ++column) {
+          sum += plane[row * linesize + column];
+        }
+      }
+      uint8_t average = (uint8_t)((sum + count / 2) / count);
+      for (int row = y; row < y + blockHeight; ++row) {
+        memset(plane + row * linesize + x, average, (size_t)blockWidth);
+      }
+    }
+  }
+}
+
+
+/**
+ * Applies the blur levels of one row of macroblocks to the freshly
+ * converted rows `[firstRow, firstRow + rows)` of `frame`: level 1 averages
+ * 2x2 luma blocks, level 2 averages 4x4 luma blocks and 2x2 chroma blocks.
+ * The detail smoothed out is what the encoder no longer spends bits on.
+ * Macroblocks at level 0 are left untouched.
+**/
+static void filter_blur_band(AVFrame *frame, const int8_t *levels, int columns,
+                             int firstRow, int rows) {
+  for (int column = 0; column < columns; ++column) {
+    if (levels[column] == 0) continue;
+
+    int x = column * BLUR_BLOCK_SIZE;
+    int width = (int)umin(BLUR_BLOCK_SIZE, (size_t)(frame->width - x));
+    if (levels[column] == 1) {
+      average_blocks(frame->data[0], frame->linesize[0], x, firstRow, width, rows, 2);
+    } else {
+      average_blocks(frame->data[0], frame->linesize[0], x, firstRow, width, rows, 4);
+      for (int plane = 1; plane < 3; ++plane) {
+        average_blocks(frame->data[plane], frame->linesize[plane], x / 2, firstRow / 2,
+                       width / 2, rows / 2, 2);
+      }
+    }
+  }
+}
+
+
+static void convert_slice(void *arg, int task) {
+  ConversionJob *job = arg;
+  ConversionSlice *slice = &job->slices[task];
+
+  int flagged = 0;
+  for (int band = slice->firstBand; band < slice->endBand; ++band) {
+    flagged += job->bands[band];
+  }
+  if (flagged == 0) return;
+
+  int firstRow = slice->firstBand * CONVERSION_BAND_HEIGHT;
+  int endRow = (int)umin((size_t)(slice->endBand * CONVERSION_BAND_HEIGHT), (size_t)job->input->height);
+
+  // A fully changed slice is converted in one go.
+  if (flagged == slice->endBand - slice->firstBand) {
+    convert_rows(job->input, job->frame, job->picture, firstRow, endRow - firstRow);
+  } else {
+    for (int band = slice->firstBand; band < slice->endBand; ++band) {
+      if (job->bands[band]) {
+        int row = band * CONVERSION_BAND_HEIGHT;
+        convert_rows(job->input, job->frame, job->picture, row,
+                     (int)umin(CONVERSION_BAND_HEIGHT, (size_t)(endRow - row)));
+      }
+    }
+  }
+
+  for (int band = slice->firstBand; band < slice->endBand; ++band) {
+    if (job->bands[band]) {
+      int row = band * CONVERSION_BAND_HEIGHT;
+      filter_blur_band(job->frame, job->blurLevels + band * job->blurColumns, job->blurColumns,
+                       row, (int)umin(CONVERSION_BAND_HEIGHT, (size_t)(endRow - row)));
+    }
+  }
+}
+
+
+/**
+ * Converts the flagged bands of `picture` into `frame`, one task per slice.
+**/
+static void convert_bands(WorkerPool *pool, ConversionSlice *slices, int sliceCount,
+                          const InputFormat *input, AVFrame *frame,
+                          const AVPicture *picture, const uint8_t *bands,
+                          const int8_t *blurLevels, int64_t deadline) {
+  ConversionJob job;
+  job.slices = slices;
+  job.input = input;
+  job.frame = frame;
+  job.picture = picture;
+  job.bands = bands;
+  job.blurLevels = blurLevels;
+  job.blurColumns = (input->width + BLUR_BLOCK_SIZE - 1) / BLUR_BLOCK_SIZE;
+  worker_pool_run(pool, convert_slice, &job, sliceCount, deadline);
+}
+
+
+/**
+  If function returns 0 it is up to the caller to free the packet.
+**/
+static int encode_picture(AVCodecContext *encodingContext,
+                          AVFrame *frame,
+                          AVPacket *packet) {
+  // Encode the image
+  int got_packet = 0;
+  int64_t start = metrics_now();
+  int err = avcodec_encode_video2(encodingContext, packet, frame, &got_packet);
+  int64_t elapsed = metrics_record_since(metrics.encode, start) - start;
+  __atomic_fetch_add(&encoderStats.encodeTime, elapsed / 1000, __ATOMIC_RELAXED);
+  if (err < 0) {
+    fprintf(stderr, "error encoding video frame\n");
+    return -1;
+  } else if (got_packet && packet->size) {
+    packet->stream_index = VIDEO_STREAM_ID;
+    __atomic_fetch_add(&encoderStats.bytesEncoded, (uint64_t)packet->size, __ATOMIC_RELAXED);
+    return 0;
+  } else {
+    return 1;
+  }
+}
+
+
+static void encode_task(void *arg, int task) {
+  (void)task;
+  EncodeJob *job = arg;
+  job->ret = encode_picture(job->encodingContext, job->frame, job->packet);
+}
+
+
+static void send_packet(AVFormatContext *outputContext, UdpOutput *udpOutput, AVPacket* packet) {
+  // Capture microseconds to the 90 kHz clock of the transport stream.
+  AVStream *stream = outputContext->streams[packet->stream_index];
+  av_packet_rescale_ts(packet, stream->codec->time_base, stream->time_base);
+
+  // Write the compressed frame to the media output
+  int err = av_write_frame(outputContext, packet);
+  if (err < 0) {
+    fprintf(stderr, "unable to write frame: %s\n", av_err2str(err));
+    return;
+  }
+
+  // Force flushing the output context, then send every datagram of the
+  // packet in one go.
+  av_write_frame(outputContext, NULL);
+  avio_flush(outputContext->pb);
+  udp_output_flush(udpOutput);
+
+  // Free packet allocated by decoding.
+  av_free_packet(packet);
+}
+
+
+static void queue_packet(SpscQueue *q, AVPacket *packet) {
+  // Make sure the packet owns its data before it leaves the encoder thread.
+  if (av_dup_packet(packet) < 0) {
+    fprintf(stderr, "could not duplicate packet\n");
+    exit(1);
+  }
+  spsc_queue_push(q, packet);
+}
+
+
+/**
+ * Applies the rectangles of a `JOB_DIRTY_RECTS` job to `picture`, flagging
+ * the bands they touch. Returns 0 if there was nothing to apply.
+**/
+static int apply_dirty_rects(const InputFormat *input, AVPicture *picture,
+                             const VideoJob *job, uint8_t *bands) {
+  int dirty = 0;
+  const uint8_t *data = job->rects;
+  for (uint32_t i = 0; i < job->rectCount; ++i) {
+    DirtyRectData rect;
+    memcpy(&rect, data, sizeof(rect));
+    data += sizeof(rect);
+
+    size_t rowSize = (size_t)rect.width * input->bytesPerPixel;
+    for (int32_t row = rect.y; row < rect.y + rect.height; ++row) {
+      memcpy(picture->data[0] + row * picture->linesize[0] + (size_t)rect.x * input->bytesPerPixel,
+             data, rowSize);
+      data += rowSize;
+    }
+
+    if (rect.width > 0 && rect.height > 0) {
+      int lastBand = (rect.y + rect.height - 1) / CONVERSION_BAND_HEIGHT;
+      for (int band = rect.y / CONVERSION_BAND_HEIGHT; band <= lastBand; ++band) {
+        bands[band] = 1;
+      }
+      dirty = 1;
+    }
+  }
+  return dirty;
+}
+
+
+/**
+ * Fills `levels` with the blur level of every macroblock from the
+ * rectangles of a `JOB_BLUR` job. A macroblock takes the level of the last
+ * rectangle holding its center, macroblocks near the cursor get 0.
+**/
+static void build_blur_map(const VideoJob *job, int8_t *levels, int columns, int rows) {
+  BlurData blur;
+  memcpy(&blur, job->rects, sizeof(blur));
+  const uint8_t *data = job->rects + sizeof(blur);
+
+  memset(levels, 0, (size_t)columns * (size_t)rows);
+  for (uint32_t i = 0; i < blur.rectCount; ++i) {
+    BlurRectData rect;
+    memcpy(&rect, data, sizeof(rect));
+    data += sizeof(rect);
+
+    for (int row = 0; row < rows; ++row) {
+      int centerY = row * BLUR_BLOCK_SIZE + BLUR_BLOCK_SIZE / 2;
+      if (centerY < rect.y || centerY >= rect.y + rect.height) continue;
+      for (int column = 0; column < columns; ++column) {
+        int centerX = column * BLUR_BLOCK_SIZE + BLUR_BLOCK_SIZE / 2;
+        if (centerX >= rect.x && centerX < rect.x + rect.width) {
+          levels[row * columns + column] = (int8_t)rect.level;
+        }
+      }
+    }
+  }
+
+  if (blur.cursorX >= 0 && blur.cursorY >= 0) {
+    int firstColumn = blur.cursorX > BLUR_CURSOR_RADIUS ? (blur.cursorX - BLUR_CURSOR_RADIUS) / BLUR_BLOCK_SIZE : 0;
+    int firstRow = blur.cursorY > BLUR_CURSOR_RADIUS ? (blur.cursorY - BLUR_CURSOR_RADIUS) / BLUR_BLOCK_SIZE : 0;
+    int endColumn = (int)umin((size_t)columns, (size_t)((blur.cursorX + BLUR_CURSOR_RADIUS) / BLUR_BLOCK_SIZE + 1));
+    int endRow = (int)umin((size_t)rows, (size_t)((blur.cursorY + BLUR_CURSOR_RADIUS) / BLUR_BLOCK_SIZE + 1));
+    for (int row = firstRow; row < endRow; ++row) {
+      for (int column = firstColumn; column < endColumn; ++column) {
+        levels[row * columns + column] = 0;
+      }
+    }
+  }
+}
+
+
+/**
+ * Splits `bandCount` bands into slices of whole bands, one conversion
+ * task each.
+**/
+static ConversionSlice *create_slices(int bandCount, int *sliceCount) {
+  int count = conversionSlices > 0 ? conversionSlices : av_cpu_count();
+  if (count > bandCount) count = bandCount;
+  if (count < 1) count = 1;
+  int bandsPerSlice = (bandCount + count - 1) / count;
+  count = (bandCount + bandsPerSlice - 1) / bandsPerSlice;
+
+  ConversionSlice *slices = calloc((size_t)count, sizeof(ConversionSlice));
+  if (!slices) {
+    fprintf(stderr, "unable to allocate conversion slices\n");
+    exit(1);
+  }
+  for (int i = 0; i < count; ++i) {
+    slices[i].firstBand = i * bandsPerSlice;
+    slices[i].endBand = (int)umin((size_t)((i + 1) * bandsPerSlice), (size_t)bandCount);
+  }
+  *sliceCount = count;
+  return slices;
+}
+
+
+/**
+ * Swaps the picture of `job` with `picture`, along with their formats.
+**/
+static void swap_job_picture(VideoJob *job, AVPicture *picture, InputFormat *format) {
+  AVPicture previousPicture = *picture;
+  InputFormat previousFormat = *format;
+  *picture = job->picture;
+  *format = job->format;
+  job->picture = previousPicture;
+  job->format = previousFormat;
+}
+
+
+/**
+ * Hands a new `FRM\n` to the converter through `latestFrame`. When the
+ * converter has not taken the previous one yet, it is dropped and returned
+ * for the reader to reuse, otherwise NULL is. So however far behind the
+ * encoder is, the reader keeps draining the input and the converter always
+ * gets the newest frame.
+**/
+static VideoJob *post_frame(Pipeline *pipeline, VideoJob *job) {
+  pthread_mutex_lock(&pipeline->latestFrameMutex);
+  VideoJob *dropped = pipeline->latestFrame;
+  pipeline->latestFrame = job;
+  pthread_mutex_unlock(&pipeline->latestFrameMutex);
+  sem_post(&pipeline->jobsReady);
+
+  if (dropped) {
+    __atomic_fetch_add(&encoderStats.framesDropped, 1, __ATOMIC_RELAXED);
+    metrics_add(metrics.framesDropped, 1);
+  }
+  return dropped;
+}
+
+
+/**
+ * A job for the reader to fill, the spare one if there is one.
+**/
+static VideoJob *take_free_job(Session *session) {
+  VideoJob *job = session->spareJob;
+  session->spareJob = NULL;
+  if (!job) spsc_queue_pop(&session->pipeline.freeJobs, &job);
+  return job;
+}
+
+
+/**
+ * Queues any other job for the converter, after the posted frame if there
+ * is one so that the order of the commands is kept.
+**/
+static void queue_job(Pipeline *pipeline, VideoJob *job) {
+  pthread_mutex_lock(&pipeline->latestFrameMutex);
+  VideoJob *latest = pipeline->latestFrame;
+  pipeline->latestFrame = NULL;
+  pthread_mutex_unlock(&pipeline->latestFrameMutex);
+
+  if (latest) spsc_queue_push(&pipeline->jobs, &latest);
+  spsc_queue_push(&pipeline->jobs, &job);
+}
+
+
+/**
+ * Waits for the next job of the converter. The posted frame is newer than
+ * every queued job, so it only comes once the queue is empty.
+**/
+static VideoJob *take_job(Pipeline *pipeline) {
+  while (1) {
+    spsc_queue_wait(&pipeline->jobsReady);
+
+    VideoJob *job = NULL;
+    if (spsc_queue_try_pop(&pipeline->jobs, &job)) {
+      return job;
+    }
+    pthread_mutex_lock(&pipeline->latestFrameMutex);
+    job = pipeline->latestFrame;
+    pipeline->latestFrame = NULL;
+    pthread_mutex_unlock(&pipeline->latestFrameMutex);
+    // Posts outnumber jobs when frames were replaced or moved to the queue.
+    if (job) return job;
+  }
+}
+
+
+/**
+ * Converter stage. Keeps the picture every band is converted from,
+ * decides which frames are worth encoding and converts them.
+ *
+ * Everything sized by the input format is built by the `JOB_CONFIG` the
+ * reader queues first, and rebuilt by every later one.
+**/
+static void *convert_thread(void *arg) {
+  Pipeline *pipeline = arg;
+
+  InputFormat input;
+  memset(&input, 0, sizeof(input));
+  int bandCount = 0;
+  uint8_t *bands = NULL;
+  uint64_t *bandHashes = NULL;
+  uint32_t *bandVersions = NULL;
+  int bandHashesValid = 0;
+  // Levels of the last `BLR\n`, a row of macroblocks per band, and the
+  // buffer the next one is built in.
+  int blurColumns = 0;
+  int8_t *blurLevels = NULL;
+  int8_t *nextBlurLevels = NULL;
+  int skippedInRow = 0;
+  int encodedSinceChange = 0;
+  uint32_t configuration = 0;
+  int keyframePending = 0;
+
+  ConversionSlice *slices = NULL;
+  int sliceCount = 0;
+
+  // The converter thread takes part in the conversion so it only needs
+  // one worker less than there are slices. Sessions of a server share
+  // its pool instead.
+  WorkerPool ownPool;
+  WorkerPool *pool = sharedPool;
+  if (!pool) {
+    int maxSlices = conversionSlices > 0 ? conversionSlices : av_cpu_count();
+    int workers = (int)umin((size_t)maxSlices, (size_t)av_cpu_count()) - 1;
+    worker_pool_init(&ownPool, workers > 0 ? workers : 0, 1);
+    pool = &ownPool;
+  }
+
+  // Rows are kept tightly packed, matching the `FRM\n` data swapped
+  // into it and patched by `DRT\n`.
+  AVPicture picture;
+  memset(&picture, 0, sizeof(picture));
+
+  // The last `SHM\n` slot is held on to until the next frame, in case
+  // `DRT\n` has to patch on top of it.
+  AVPicture slotPicture;
+  memset(&slotPicture, 0, sizeof(slotPicture));
+  int64_t retainedSlot = -1;
+  const AVPicture *source = &picture;
+
+  while (1) {
+    VideoJob *job = take_job(pipeline);
+
+    if (job->type == JOB_END) {
+      VideoFrame *end = NULL;
+      spsc_queue_push(&pipeline->frames, &end);
+      break;
+    }
+
+    int changed = 0;
+    int64_t pts = job->pts;
+    int64_t deadline = job->deadline;
+    if (job->type == JOB_CONFIG) {
+      if (retainedSlot >= 0) shm_ring_release((uint32_t)retainedSlot);
+      retainedSlot = -1;
+
+      // Start over from a blank picture of the new format.
+      swap_job_picture(job, &picture, &input);
+      clear_input_picture(&picture, &input);
+      source = &picture;
+      spsc_queue_push(&pipeline->freeJobs, &job);
+
+      free(slices);
+      free(bands);
+      free(bandHashes);
+      free(bandVersions);
+      free(blurLevels);
+      free(nextBlurLevels);
+      bandCount = (input.height + CONVERSION_BAND_HEIGHT - 1) / CONVERSION_BAND_HEIGHT;
+      bands = calloc((size_t)bandCount, 1);
+      bandHashes = calloc((size_t)bandCount, sizeof(uint64_t));
+      bandVersions = calloc((size_t)bandCount, sizeof(uint32_t));
+      // Rectangles of the previous size mean nothing to the new one.
+      blurColumns = (input.width + BLUR_BLOCK_SIZE - 1) / BLUR_BLOCK_SIZE;
+      blurLevels = calloc((size_t)blurColumns, (size_t)bandCount);
+      nextBlurLevels = calloc((size_t)blurColumns, (size_t)bandCount);
+      if (!bands || !bandHashes || !bandVersions || !blurLevels || !nextBlurLevels) {
+        fprintf(stderr, "unable to allocate bands\n");
+        exit(1);
+      }
+      slices = create_slices(bandCount, &sliceCount);
+
+      bandHashesValid = 0;
+      ++configuration;
+      keyframePending = 1;
+      continue;
+    } else if (job->type == JOB_STRIDE) {
+      // Same pixels with the rows further apart: the picture, the bands
+      // and the encoder carry on as they are.
+      av_image_copy(job->picture.data, job->picture.linesize,
+                    (const uint8_t **)source->data, source->linesize,
+                    input.pixelFormat, input.width, input.height);
+      if (retainedSlot >= 0) shm_ring_release((uint32_t)retainedSlot);
+      retainedSlot = -1;
+      swap_job_picture(job, &picture, &input);
+      source = &picture;
+      spsc_queue_push(&pipeline->freeJobs, &job);
+
+      // Padded rows hash differently, only the hashes are brought up to date.
+      if (bandHashesValid) {
+        memset(bands, 1, (size_t)bandCount);
+        refresh_bands(&input, source, bandHashes, bands, bandCount);
+      }
+      continue;
+    } else if (job->type == JOB_FRAME) {
+      // Adopt the job picture, the job gets our old one back.
+      swap_job_picture(job, &picture, &input);
+
+      if (retainedSlot >= 0) shm_ring_release((uint32_t)retainedSlot);
+      retainedSlot = -1;
+      source = &picture;
+
+      memset(bands, 1, (size_t)bandCount);
+      changed = refresh_bands(&input, source, bandHashes, bands, bandCount);
+    } else if (job->type == JOB_SHM_FRAME) {
+      if (retainedSlot >= 0 && retainedSlot != job->slot) {
+        shm_ring_release((uint32_t)retainedSlot);
+      }
+      retainedSlot = job->slot;
+      fill_input_planes(&slotPicture, shm_ring_slot(job->slot), &input);
+      source = &slotPicture;
+
+      memset(bands, 1, (size_t)bandCount);
+      changed = refresh_bands(&input, source, bandHashes, bands, bandCount);
+    } else if (job->type == JOB_DIRTY_RECTS) {
+      if (retainedSlot >= 0) {
+        av_image_copy(picture.data, picture.linesize,
+                      (const uint8_t **)slotPicture.data, slotPicture.linesize,
+                      input.pixelFormat, input.width, input.height);
+        shm_ring_release((uint32_t)retainedSlot);
+        retainedSlot = -1;
+        source = &picture;
+      }
+
+      memset(bands, 0, (size_t)bandCount);
+      if (!apply_dirty_rects(&input, &picture, job, bands)) {
+        // No rectangles, no frame.
+        spsc_queue_push(&pipeline->freeJobs, &job);
+        continue;
+      }
+      // Rectangles may repaint what was already there.
+      changed = refresh_bands(&input, source, bandHashes, bands, bandCount);
+    } else if (job->type == JOB_BLUR) {
+      build_blur_map(job, nextBlurLevels, blurColumns, bandCount);
+      // Bands whose levels changed are converted and filtered again.
+      for (int band = 0; band < bandCount; ++band) {
+        bands[band] = memcmp(nextBlurLevels + band * blurColumns,
+                             blurLevels + band * blurColumns, (size_t)blurColumns) != 0;
+        changed += bands[band];
+      }
+      int8_t *previous = blurLevels;
+      blurLevels = nextBlurLevels;
+      nextBlurLevels = previous;
+      if (!changed) {
+        spsc_queue_push(&pipeline->freeJobs, &job);
+        continue;
+      }
+    }
+    spsc_queue_push(&pipeline->freeJobs, &job);
+
+    if (!bandHashesValid) {
+      memset(bands, 1, (size_t)bandCount);
+      bandHashesValid = changed = 1;
+    }
+    for (int band = 0; band < bandCount; ++band) {
+      bandVersions[band] += bands[band];
+    }
+
+    // With intra refresh a full refresh period is still encoded after every
+    // change, so losses are repaired before the stream goes quiet.
+    if (changed) {
+      encodedSinceChange = 0;
+    } else if (encodedSinceChange >= refreshPeriod && skippedInRow < MAX_SKIPPED_FRAMES) {
+      ++skippedInRow;
+      __atomic_fetch_add(&encoderStats.framesSkipped, 1, __ATOMIC_RELAXED);
+      metrics_add(metrics.framesSkipped, 1);
+      continue;
+    }
+    skippedInRow = 0;
+    ++encodedSinceChange;
+
+    VideoFrame *frame = NULL;
+    spsc_queue_pop(&pipeline->freeFrames, &frame);
+    if (frame->configuration != configuration) {
+      // First use since the format changed, start out of date so every
+      // band is converted.
+      if (!frame->frame || frame->frame->width != input.width ||
+          frame->frame->height != input.height) {
+        if (frame->frame) free_video_frame(frame->frame);
+        frame->frame = alloc_video_frame(input.width, input.height);
+      }
+      frame->bandVersions = realloc(frame->bandVersions, (size_t)bandCount * sizeof(uint32_t));
+      if (!frame->bandVersions) {
+        fprintf(stderr, "unable to allocate bands\n");
+        exit(1);
+      }
+      for (int band = 0; band < bandCount; ++band) frame->bandVersions[band] = UINT32_MAX;
+      frame->configuration = configuration;
+    }
+    frame->keyframe = keyframePending;
+    frame->pts = pts;
+    frame->deadline = deadline;
+    keyframePending = 0;
+
+    for (int band = 0; band < bandCount; ++band) {
+      bands[band] = frame->bandVersions[band] != bandVersions[band];
+      frame->bandVersions[band] = bandVersions[band];
+    }
+    int64_t start = metrics_now();
+    convert_bands(pool, slices, sliceCount, &input, frame->frame, source, bands,
+                  blurLevels, deadline);
+    metrics_record_since(metrics.convert, start);
+    spsc_queue_push(&pipeline->frames, &frame);
+  }
+
+  if (retainedSlot >= 0) shm_ring_release((uint32_t)retainedSlot);
+  if (pool == &ownPool) worker_pool_destroy(&ownPool);
+  free(slices);
+  free(bands);
+  free(bandHashes);
+  free(bandVersions);
+  free(blurLevels);
+  free(nextBlurLevels);
+  av_freep(&picture.data[0]);
+  return NULL;
+}
+
+
+/**
+ * Retargets the VBV of a running encoder, keeping the buffer as many
+ * frames long as it was configured. libx264 reconfigures itself on the
+ * next frame when it sees the new rates.
+**/
+static void set_bitrate(AVCodecContext *encodingContext, uint32_t kbps) {
+  encodingContext->rc_buffer_size = (int)((int64_t)vbvBufferSize * kbps * 1000 / maxBitrate);
+  encodingContext->rc_max_rate = (int64_t)kbps * 1000;
+  if (constantBitrate) {
+    encodingContext->bit_rate = (int64_t)kbps * 1000;
+  }
+}
+
+
+/**
+ * Opens `encodingContext` for `width`x`height` pictures. Also used to
+ * reopen it after `avcodec_close()` when the input geometry changes, which
+ * is why the private options go through a dictionary: closing frees them.
+ * Returns 0 if libx264 rejects the settings.
+**/
+static int open_video_encoder(AVCodecContext *encodingContext, AVCodec *encoder,
+                              int width, int height, uint32_t kbps) {
+  // Resolution must be a multiple of two
+  encodingContext->width = width;
+  encodingContext->height = height;
+  // Set default encoding parameters. Timestamps are capture times in
+  // microseconds, as sent by the capture process.
+  encodingContext->time_base.num = 1;
+  encodingContext->time_base.den = 1000000;
+  encodingContext->has_b_frames = 0; // We don't want b frames
+  encodingContext->max_b_frames = 0;
+  encodingContext->pix_fmt = AV_PIX_FMT_YUV420P;
+  if (sharedPool) {
+    // The shared pool provides the parallelism, across sessions.
+    encodingContext->thread_count = 1;
+  }
+
+  AVDictionary *options = NULL;
+  if (refreshPeriod > 0) {
+    // P frames only, a column of intra blocks sweeps the picture every
+    // `refreshPeriod` frames instead of sending whole intra frames.
+    encodingContext->gop_size = refreshPeriod;
+    av_dict_set(&options, "intra-refresh", "1", 0);
+  } else {
+    encodingContext->gop_size = 0; // Emit only intra frames
+    encodingContext->me_method = 1; // No motion estimation
+  }
+  // Frames forced to intra after a reconfiguration must be IDR frames.
+  av_dict_set(&options, "forced-idr", "1", 0);
+
+  // Set the same presets as in the command line
+  av_dict_set(&options, "preset", "ultrafast", 0);
+  av_dict_set(&options, "tune", "zerolatency", 0);
+  if (constantBitrate) {
+    // Average at the ceiling, filler keeps the rate constant on the wire.
+    av_dict_set(&options, "nal-hrd", "cbr", 0);
+  } else {
+    // Quality driven, the VBV only caps the spikes.
+    av_dict_set(&options, "crf", "20", 0);
+  }
+  if (maxBitrate) {
+    set_bitrate(encodingContext, kbps);
+  }
+  // The microsecond time base would otherwise pass for a million frames
+  // per second, leaving rate control next to no bits per frame.
+  char x264Params[32];
+  snprintf(x264Params, sizeof(x264Params), "fps=%d", frameRate);
+  av_dict_set(&options, "x264-params", x264Params, 0);
+
+  // Open encoding context for our encoder
+  int err = avcodec_open2(encodingContext, encoder, &options);
+  av_dict_free(&options);
+  if (err < 0) {
+    fprintf(stderr, "error opening encoder for %ix%i\n", width, height);
+    return 0;
+  }
+  return 1;
+}
+
+
+static void *encode_thread(void *arg) {
+  Pipeline *pipeline = arg;
+  uint32_t bitrate = (uint32_t)maxBitrate;
+  int64_t lastPts = INT64_MIN;
+  int opened = 1; // 0 while libx264 rejects the current size
+
+  int ended = 0;
+  while (!ended) {
+    VideoFrame *frame = NULL;
+    spsc_queue_pop(&pipeline->frames, &frame);
+    if (!frame) break;
+
+    // Latest frame wins, older ones still queued are not worth the wait.
+    VideoFrame *newer = NULL;
+    while (!keepAllFrames && spsc_queue_try_pop(&pipeline->frames, &newer)) {
+      if (!newer) {
+        ended = 1;
+        break;
+      }
+      newer->keyframe |= frame->keyframe;
+      spsc_queue_push(&pipeline->freeFrames, &frame);
+      __atomic_fetch_add(&encoderStats.framesDropped, 1, __ATOMIC_RELAXED);
+      metrics_add(metrics.framesDropped, 1);
+      frame = newer;
+    }
+
+    AVCodecContext *encodingContext = pipeline->videoEncodingContext;
+    uint32_t target = __atomic_load_n(&pipeline->targetBitrate, __ATOMIC_RELAXED);
+    if (target != bitrate) {
+      set_bitrate(encodingContext, target);
+      bitrate = target;
+    }
+
+    // The mpegts muxer keeps going, the new SPS travels with the next IDR.
+    if (frame->frame->width != encodingContext->width ||
+        frame->frame->height != encodingContext->height) {
+      avcodec_close(encodingContext);
+      opened = open_video_encoder(encodingContext, pipeline->videoEncoder,
+                                  frame->frame->width, frame->frame->height, bitrate);
+    }
+    if (!opened) {
+      // Frames are dropped until a `CFG\n` brings a size that works, the
+      // other sessions of the process carry on.
+      spsc_queue_push(&pipeline->freeFrames, &frame);
+      __atomic_fetch_add(&encoderStats.framesDropped, 1, __ATOMIC_RELAXED);
+      metrics_add(metrics.framesDropped, 1);
+      continue;
+    }
+    frame->frame->pict_type = frame->keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    // The muxer drops packets whose timestamps do not increase, which
+    // repeated or out of order capture times would otherwise cause.
+    lastPts = frame->pts > lastPts ? frame->pts : lastPts + 1;
+    frame->frame->pts = lastPts;
+
+    AVPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    int ret;
+    if (sharedPool) {
+      // Encoders of all sessions take turns on the pool, so no more of
+      // them run at once than there are cores.
+      EncodeJob job = { encodingContext, frame->frame, &packet, 0 };
+      worker_pool_run(sharedPool, encode_task, &job, 1, frame->deadline);
+      ret = job.ret;
+    } else {
+      ret = encode_picture(encodingContext, frame->frame, &packet);
+    }
+    spsc_queue_push(&pipeline->freeFrames, &frame);
+    if (ret == 0) {
+      __atomic_fetch_add(&encoderStats.framesEncoded, 1, __ATOMIC_RELAXED);
+      metrics_add(metrics.framesEncoded, 1);
+      queue_packet(&pipeline->videoPackets, &packet);
+    }
+  }
+
+  // An empty packet tells the sender this lane is done.
+  AVPacket end;
+  memset(&end, 0, sizeof(end));
+  spsc_queue_push(&pipeline->videoPackets, &end);
+  return NULL;
+}
+
+
+static void *audio_thread(void *arg) {
+  Pipeline *pipeline = arg;
+
+  while (1) {
+    AudioBuffer buffer;
+    spsc_queue_pop(&pipeline->audio, &buffer);
+    if (!buffer.data) break;
+
+    AVPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    int ret = encode_audio(pipeline, &buffer, &packet);
+    spsc_queue_push(&pipeline->freeAudio, &buffer);
+    if (ret == 0) {
+      queue_packet(&pipeline->audioPackets, &packet);
+    }
+  }
+
+  AVPacket end;
+  memset(&end, 0, sizeof(end));
+  spsc_queue_push(&pipeline->audioPackets, &end);
+  return NULL;
+}
+
+
+/**
+ * Sender stage, the only thread touching the output context.
+**/
+static void *send_thread(void *arg) {
+  Pipeline *pipeline = arg;
+  int lanes = pipeline->aCodecCtx ? 2 : 1;
+
+  while (lanes > 0) {
+    spsc_queue_wait(&pipeline->packetsReady);
+
+    AVPacket packet;
+    if (!spsc_queue_try_pop(&pipeline->videoPackets, &packet) &&
+        !spsc_queue_try_pop(&pipeline->audioPackets, &packet)) {
+      continue;
+    }
+
+    if (!packet.data) {
+      --lanes;
+    } else {
+      int64_t start = metrics_now();
+      send_packet(pipeline->outputContext, pipeline->udpOutput, &packet);
+      metrics_record_since(metrics.send, start);
+    }
+  }
+  return NULL;
+}
+
+
+static void start_thread(pthread_t *thread, void *(*routine)(void *), void *arg) {
+  int err = pthread_create(thread, NULL, routine, arg);
+  if (err != 0) {
+    fprintf(stderr, "unable to start thread: %s\n", strerror(err));
+    exit(1);
+  }
+}
+
+
+static int same_input_format(const InputFormat *a, const InputFormat *b) {
+  return a->width == b->width && a->height == b->height &&
+         a->pixelFormat == b->pixelFormat && a->bytesPerPixel == b->bytesPerPixel &&
+         a->stride == b->stride;
+}
+
+
+/**
+ * Makes sure the picture of `job` is allocated for `format`. Jobs come back
+ * with whatever picture the converter gave them, possibly of an older format.
+**/
+static void prepare_job_picture(VideoJob *job, const InputFormat *format) {
+  if (!job->picture.data[0] || !same_input_format(&job->format, format)) {
+    av_freep(&job->picture.data[0]);
+    alloc_input_picture(&job->picture, format);
+    job->format = *format;
+  }
+}
+
+
+/**
+ * Validates the size and PIX_FMT of the input, returns 0 and leaves
+ * `format` alone if they are not usable.
+**/
+static int parse_input_format(InputFormat *format, uint32_t width, uint32_t height,
+                              const char *pixelFormat) {
+  if (width == 0 || height == 0 || width > INT16_MAX || height > INT16_MAX ||
+      width % 2 != 0 || height % 2 != 0) {
+    fprintf(stderr, "invalid size: %ux%u\n", width, height);
+    return 0;
+  }
+  enum AVPixelFormat pixFmt = pix_fmt_str_to_enum(pixelFormat);
+  if (pixFmt == AV_PIX_FMT_NONE) {
+    return 0;
+  }
+
+  format->width = (int32_t)width;
+  format->height = (int32_t)height;
+  format->pixelFormat = pixFmt;
+  format->bytesPerPixel = pix_fmt_to_bytes_per_pixel(pixelFormat);
+  format->stride = (int32_t)(width * format->bytesPerPixel);
+  return 1;
+}
+
+
+/**
+ * Reads the payload of a `CFG\n` command into `format`.
+ * Like every reader function, returns 0 if the command is malformed.
+**/
+static int read_config(FILE *input, InputFormat *format) {
+  ConfigData config;
+  if (fread(&config, sizeof(config), 1, input) != 1) {
+    perror("unable to read configuration");
+    return 0;
+  }
+
+  char pixelFormat[sizeof(config.pixelFormat) + 1] = {0};
+  memcpy(pixelFormat, config.pixelFormat, sizeof(config.pixelFormat));
+  return parse_input_format(format, config.width, config.height, pixelFormat);
+}
+
+
+/**
+ * Reads the row stride of a `STR\n` command into `format`, returns 0 and
+ * leaves it untouched if it is smaller than a row or absurdly large.
+**/
+static int read_stride(FILE *input, InputFormat *format) {
+  uint32_t stride = 0;
+  if (fread(&stride, sizeof(stride), 1, input) != 1) {
+    perror("unable to read stride");
+    return 0;
+  }
+  // More padding than that is a corrupt command rather than alignment.
+  size_t rowSize = (size_t)format->width * format->bytesPerPixel;
+  // I420 chroma rows get half of it.
+  if (stride < rowSize || stride > 2 * rowSize + 4096 ||
+      (format->pixelFormat == AV_PIX_FMT_YUV420P && stride % 2 != 0)) {
+    fprintf(stderr, "invalid stride: %u\n", stride);
+    return 0;
+  }
+  format->stride = (int32_t)stride;
+  return 1;
+}
+
+
+/**
+ * Reads the pixels of a `DRT\n` command into `job`, validating the rectangles.
+**/
+static int read_dirty_rects(FILE *input, VideoJob *job, const InputFormat *format) {
+  if (fread(&job->rectCount, sizeof(job->rectCount), 1, input) != 1) {
+    perror("unable to read dirty rectangle count");
+    return 0;
+  }
+  if (av_pix_fmt_count_planes(format->pixelFormat) > 1) {
+    fprintf(stderr, "DRT is not supported for planar PIX_FMT\n");
+    return 0;
+  }
+  // YUYV422 pixels come in pairs sharing their chroma.
+  int pairMask = (1 << av_pix_fmt_desc_get(format->pixelFormat)->log2_chroma_w) - 1;
+
+  job->rectsSize = 0;
+  for (uint32_t i = 0; i < job->rectCount; ++i) {
+    DirtyRectData rect;
+    if (fread(&rect, sizeof(rect), 1, input) != 1) {
+      perror("unable to read dirty rectangle");
+      return 0;
+    }
+    if (rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0 ||
+        rect.width > format->width - rect.x || rect.height > format->height - rect.y ||
+        ((rect.x | rect.width) & pairMask) != 0) {
+      fprintf(stderr, "invalid dirty rectangle: %ix%i+%i+%i\n",
+              rect.width, rect.height, rect.x, rect.y);
+      return 0;
+    }
+
+    size_t dataSize = (size_t)rect.width * (size_t)rect.height * format->bytesPerPixel;
+    size_t needed = job->rectsSize + sizeof(rect) + dataSize;
+    if (needed > job->rectsCapacity) {
+      job->rectsCapacity = needed * 2;
+      job->rects = realloc(job->rects, job->rectsCapacity);
+      if (!job->rects) {
+        fprintf(stderr, "unable to allocate dirty rectangles\n");
+        exit(1);
+      }
+    }
+
+    memcpy(job->rects + job->rectsSize, &rect, sizeof(rect));
+    job->rectsSize += sizeof(rect);
+    if (fread(job->rects + job->rectsSize, 1, dataSize, input) != dataSize) {
+      perror("unable to read dirty rectangle data");
+      return 0;
+    }
+    job->rectsSize += dataSize;
+  }
+  return 1;
+}
+
+
+/**
+ * Reads the rectangles of a `BLR\n` command into `job`, validating them.
+**/
+static int read_blur(FILE *input, VideoJob *job, const InputFormat *format) {
+  BlurData blur;
+  if (fread(&blur, sizeof(blur), 1, input) != 1) {
+    perror("unable to read blurred regions");
+    return 0;
+  }
+  if (blur.cursorX >= format->width || blur.cursorY >= format->height) {
+    fprintf(stderr, "invalid cursor position: %i,%i\n", blur.cursorX, blur.cursorY);
+    return 0;
+  }
+  if (blur.rectCount > (uint32_t)(INT32_MAX / sizeof(BlurRectData))) {
+    fprintf(stderr, "invalid blurred region count: %u\n", blur.rectCount);
+    return 0;
+  }
+
+  size_t needed = sizeof(blur) + blur.rectCount * sizeof(BlurRectData);
+  if (needed > job->rectsCapacity) {
+    job->rectsCapacity = needed * 2;
+    job->rects = realloc(job->rects, job->rectsCapacity);
+    if (!job->rects) {
+      fprintf(stderr, "unable to allocate blurred regions\n");
+      exit(1);
+    }
+  }
+  memcpy(job->rects, &blur, sizeof(blur));
+  job->rectsSize = sizeof(blur);
+
+  for (uint32_t i = 0; i < blur.rectCount; ++i) {
+    BlurRectData rect;
+    if (fread(&rect, sizeof(rect), 1, input) != 1) {
+      perror("unable to read blurred region");
+      return 0;
+    }
+    if (rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0 ||
+        rect.width > format->width - rect.x || rect.height > format->height - rect.y ||
+        rect.level < 0 || rect.level > BLUR_MAX_LEVEL) {
+      fprintf(stderr, "invalid blurred region: %ix%i+%i+%i level %i\n",
+              rect.width, rect.height, rect.x, rect.y, rect.level);
+      return 0;
+    }
+    memcpy(job->rects + job->rectsSize, &rect, sizeof(rect));
+    job->rectsSize += sizeof(rect);
+  }
+  return 1;
+}
+
+
+/**
+ * Closes the encoders of every stream of `outputContext` and frees it.
+**/
+static void close_output(AVFormatContext *outputContext) {
+  for (unsigned i = 0; i < outputContext->nb_streams; ++i) {
+    avcodec_close(outputContext->streams[i]->codec);
+  }
+  avformat_free_context(outputContext);
+}
+
+
+/**
+ * Opens the video encoder, the audio one unless `inputSampleFormat` is
+ * `AV_SAMPLE_FMT_NONE`, and the mpegts muxer writing to `udpOutput`, then
+ * sends the stream header. Video is the first stream and audio the second.
+ * Returns NULL if any of them cannot be set up, so that one bad session
+ * does not end every other session of a `-S` server.
+**/
+static AVFormatContext *open_output(UdpOutput *udpOutput, const char *host, const char *port,
+                                    const InputFormat *format, AVCodec **videoEncoder,
+                                    enum AVSampleFormat inputSampleFormat, int sampleRate) {
+  // Alloc context for outputting the data.
+  char outputAddr[256] = {0};
+  snprintf(outputAddr, sizeof(outputAddr), "udp://%s:%s", host, port);
+  AVFormatContext *outputContext = NULL;
+  avformat_alloc_output_context2(&outputContext, NULL, "mpegts", outputAddr);
+  if (!outputContext) {
+    fprintf(stderr, "error allocating output context\n");
+    return NULL;
+  }
+
+  // Find the H.264 encoder. The `encoder` struct must be "opened" before using.
+  *videoEncoder = avcodec_find_encoder_by_name("libx264");
+  if (!*videoEncoder) {
+    fprintf(stderr, "x264 encoder not found\n");
+    close_output(outputContext);
+    return NULL;
+  }
+
+  // Add the video stream to the output. This stream will contain video frames.
+  AVStream *videoStream = avformat_new_stream(outputContext, *videoEncoder);
+  if (!videoStream) {
+    fprintf(stderr, "error when creating videoStream\n");
+    close_output(outputContext);
+    return NULL;
+  }
+  // Configure the stream ID (needed for transmitting it)
+  videoStream->id = VIDEO_STREAM_ID;
+
+  // Grab the encoding context from format.
+  if (!open_video_encoder(videoStream->codec, *videoEncoder,
+                          format->width, format->height, (uint32_t)maxBitrate)) {
+    close_output(outputContext);
+    return NULL;
+  }
+
+  if (inputSampleFormat != AV_SAMPLE_FMT_NONE) {
+    // Find the AAC or Opus encoder. The `encoder` struct must be "opened" before using.
+    AVCodec *audioEncoder = avcodec_find_encoder_by_name(opusAudio ? "libopus" : "libfaac");
+    if (!audioEncoder) {
+      fprintf(stderr, "%s encoder not found\n", opusAudio ? "Opus" : "AAC");
+      close_output(outputContext);
+      return NULL;
+    }
+
+    // Add the audio stream to the output. This stream will contain audio frames.
+    AVStream *audioStream = avformat_new_stream(outputContext, audioEncoder);
+    if (!audioStream) {
+      fprintf(stderr, "error when creating audioStream\n");
+      close_output(outputContext);
+      return NULL;
+    }
+    // Configure the stream ID (needed for transmitting it)
+    audioStream->id = AUDIO_STREAM_ID;
+
+    // Grab the encoding context from format.
+    AVCodecContext *aCodecCtx = audioStream->codec;
+
+    aCodecCtx->sample_fmt = audioEncoder->sample_fmts[0];
+    aCodecCtx->time_base.num = 1;
+    aCodecCtx->time_base.den = 1000000;
+    aCodecCtx->bit_rate = 128000;
+    aCodecCtx->sample_rate = sampleRate;
+    aCodecCtx->channels = av_get_channel_layout_nb_channels(AV_CH_LAYOUT_STEREO);
+    aCodecCtx->channel_layout = AV_CH_LAYOUT_STEREO;
+
+    AVDictionary *options = NULL;
+    if (opusAudio) {
+      // Restricted low delay drops the speech modes and their lookahead.
+      av_dict_set(&options, "application", "lowdelay", 0);
+      av_dict_set(&options, "frame_duration", opusFrameDuration, 0);
+    }
+
+    // Open encoding context for our encoder
+    int err = avcodec_open2(aCodecCtx, audioEncoder, &options);
+    av_dict_free(&options);
+    if (err < 0) {
+      fprintf(stderr, "error opening encoder\n");
+      close_output(outputContext);
+      return NULL;
+    }
+  }
+
+  outputContext->pb = udp_output_context(udpOutput);
+  // No muxing delay, timestamps on the wire are the capture times.
+  outputContext->max_delay = 0;
+
+  // Write transport stream header (PAT, PMT, etc).
+  // This segfaults without an output buffer.
+  if (avformat_write_header(outputContext, NULL) < 0) {
+    fprintf(stderr, "error writing mpegts header\n");
+    close_output(outputContext);
+    return NULL;
+  }
+  avio_flush(outputContext->pb);
+  udp_output_flush(udpOutput);
+  return outputContext;
+}
+
+
+/**
+ * Sets up a session reading from `input` and sending to `host`:`port` and
+ * every `HOST:PORT` of `destinations` (split in place), and starts its
+ * threads. Returns NULL if the audio format, a destination, an encoder or
+ * the muxer is not usable.
+**/
+static Session *session_open(FILE *input, const InputFormat *format,
+                             const char *audioFormat, int sampleRate,
+                             const char *host, const char *port,
+                             char **destinations, int destinationCount) {
+  enum AVSampleFormat inputSampleFormat = AV_SAMPLE_FMT_NONE;
+  if (audioFormat) {
+    inputSampleFormat = aud_fmt_str_to_enum(audioFormat);
+    if (inputSampleFormat == AV_SAMPLE_FMT_NONE) {
+      return NULL;
+    }
+    if (sampleRate <= 0) {
+      fprintf(stderr, "invalid sample rate: %i\n", sampleRate);
+      return NULL;
+    }
+    // The only rates of the Opus specification.
+    if (opusAudio && sampleRate != 48000 && sampleRate != 24000 && sampleRate != 16000 &&
+        sampleRate != 12000 && sampleRate != 8000) {
+      fprintf(stderr, "sample rate not supported by Opus: %i\n", sampleRate);
+      return NULL;
+    }
+  }
+
+  // Open our own output buffer rather than the udp:// protocol, which
+  // sends one datagram per syscall to a single destination.
+  UdpOutput *udpOutput = udp_output_open(pacingInterval);
+  int resolved = udp_output_add(udpOutput, host, port);
+  for (int i = 0; resolved && i < destinationCount; ++i) {
+    // Split on the last colon, so IPv6 addresses work too.
+    char *destinationPort = strrchr(destinations[i], ':');
+    *destinationPort++ = '\0';
+    resolved = udp_output_add(udpOutput, destinations[i], destinationPort);
+  }
+  if (!resolved) {
+    udp_output_close(udpOutput);
+    return NULL;
+  }
+
+  AVCodec *videoEncoder = NULL;
+  AVFormatContext *outputContext = open_output(udpOutput, host, port, format, &videoEncoder,
+                                               inputSampleFormat, sampleRate);
+  if (!outputContext) {
+    udp_output_close(udpOutput);
+    return NULL;
+  }
+  AVCodecContext *videoEncodingContext = outputContext->streams[0]->codec;
+  AVCodecContext *aCodecCtx = outputContext->nb_streams > 1 ? outputContext->streams[1]->codec : NULL;
+
+  Session *session = calloc(1, sizeof(Session));
+  if (!session) {
+    fprintf(stderr, "unable to allocate session\n");
+    exit(1);
+  }
+  session->input = input;
+  session->format = *format;
+  if (aCodecCtx) {
+    session->audioSamplesMax = (size_t)aCodecCtx->frame_size;
+    session->sampleRate = sampleRate;
+    session->audioBytesPerSample = aud_fmt_to_bytes_per_sample(audioFormat);
+  }
+
+  // Set up the pipeline. Every buffer is allocated up front and then
+  // travels between the stages, see `Pipeline`.
+  Pipeline *pipeline = &session->pipeline;
+  pipeline->outputContext = outputContext;
+  pipeline->udpOutput = udpOutput;
+  pipeline->videoEncodingContext = videoEncodingContext;
+  pipeline->videoEncoder = videoEncoder;
+  pipeline->aCodecCtx = aCodecCtx;
+  pipeline->inputSampleFormat = inputSampleFormat;
+  pipeline->targetBitrate = (uint32_t)maxBitrate;
+
+  if (sem_init(&pipeline->jobsReady, 0, 0) < 0) {
+    perror("unable to create semaphore");
+    exit(1);
+  }
+  pthread_mutex_init(&pipeline->latestFrameMutex, NULL);
+  spsc_queue_init(&pipeline->jobs, VIDEO_JOB_COUNT, sizeof(VideoJob *), &pipeline->jobsReady);
+  spsc_queue_init(&pipeline->freeJobs, VIDEO_JOB_COUNT, sizeof(VideoJob *), NULL);
+  for (int i = 0; i < VIDEO_JOB_COUNT; ++i) {
+    // Pictures are allocated by `prepare_job_picture()` once the format is known.
+    VideoJob *job = calloc(1, sizeof(VideoJob));
+    spsc_queue_push(&pipeline->freeJobs, &job);
+  }
+
+  // Frames are allocated by the converter, see `VideoFrame.configuration`.
+  spsc_queue_init(&pipeline->frames, VIDEO_FRAME_COUNT, sizeof(VideoFrame *), NULL);
+  spsc_queue_init(&pipeline->freeFrames, VIDEO_FRAME_COUNT, sizeof(VideoFrame *), NULL);
+  for (int i = 0; i < VIDEO_FRAME_COUNT; ++i) {
+    VideoFrame *frame = calloc(1, sizeof(VideoFrame));
+    spsc_queue_push(&pipeline->freeFrames, &frame);
+  }
+
+  if (sem_init(&pipeline->packetsReady, 0, 0) < 0) {
+    perror("unable to create semaphore");
+    exit(1);
+  }
+  spsc_queue_init(&pipeline->videoPackets, PACKET_QUEUE_SIZE, sizeof(AVPacket), &pipeline->packetsReady);
+  spsc_queue_init(&pipeline->audioPackets, PACKET_QUEUE_SIZE, sizeof(AVPacket), &pipeline->packetsReady);
+
+  if (aCodecCtx) {
+    spsc_queue_init(&pipeline->audio, AUDIO_BUFFER_COUNT, sizeof(AudioBuffer), NULL);
+    spsc_queue_init(&pipeline->freeAudio, AUDIO_BUFFER_COUNT, sizeof(AudioBuffer), NULL);
+    for (int i = 0; i < AUDIO_BUFFER_COUNT; ++i) {
+      AudioBuffer buffer;
+      buffer.data = malloc(session->audioBytesPerSample * session->audioSamplesMax);
+      buffer.pts = 0;
+      spsc_queue_push(&pipeline->freeAudio, &buffer);
+    }
+    spsc_queue_pop(&pipeline->freeAudio, &session->audioBuffer);
+  }
+
+  start_thread(&session->converter, convert_thread, pipeline);
+  start_thread(&session->encoder, encode_thread, pipeline);
+  if (aCodecCtx) start_thread(&session->audioEncoder, audio_thread, pipeline);
+  start_thread(&session->sender, send_thread, pipeline);
+
+  // The converter builds its state from the first configuration job,
+  // exactly as if `CFG\n` had been sent with the initial format.
+  VideoJob *config = take_free_job(session);
+  prepare_job_picture(config, format);
+  config->type = JOB_CONFIG;
+  config->deadline = av_gettime();
+  queue_job(pipeline, config);
+  return session;
+}
+
+
+/**
+ * The reader stage, runs until the end of the input. Returns 0 if it
+ * stopped at a malformed command instead.
+**/
+static int read_commands(Session *session) {
+  FILE *input = session->input;
+  Pipeline *pipeline = &session->pipeline;
+  InputFormat *format = &session->format;
+
+  while (1) {
+    CommandData header;
+    memset(&header, 0, sizeof(header));
+
+    if (fread(&header, sizeof(header), 1, input) == 1) {
+      if (strncmp(header.command, "FRM\n", 4) == 0) {
+        VideoJob *job = take_free_job(session);
+        prepare_job_picture(job, format);
+        size_t pictureSize = input_picture_size(format);
+        int64_t start = metrics_now();
+        if (fread(job->picture.data[0], 1, pictureSize, input) == pictureSize) {
+          metrics_record_since(metrics.read, start);
+          job->type = JOB_FRAME;
+          job->pts = (int64_t)header.pts;
+          job->deadline = av_gettime();
+          if (keepAllFrames) {
+            queue_job(pipeline, job);
+          } else {
+            session->spareJob = post_frame(pipeline, job);
+          }
+        } else {
+          perror("unable to read frame");
+          session->spareJob = job;
+          return 0;
+        }
+      } else if (strncmp(header.command, "SHM\n", 4) == 0) {
+        uint32_t slot = 0;
+        if (fread(&slot, sizeof(slot), 1, input) != 1) {
+          perror("unable to read shared memory slot");
+          return 0;
+        }
+        if (!shmRing || slot >= shmRing->slotCount) {
+          fprintf(stderr, "invalid shared memory slot: %u\n", slot);
+          return 0;
+        }
+        if (!shm_ring_published(slot)) {
+          fprintf(stderr, "shared memory slot not published: %u\n", slot);
+          return 0;
+        }
+
+        VideoJob *job = take_free_job(session);
+        job->type = JOB_SHM_FRAME;
+        job->pts = (int64_t)header.pts;
+        job->deadline = av_gettime();
+        job->slot = slot;
+        queue_job(pipeline, job);
+      } else if (strncmp(header.command, "DRT\n", 4) == 0) {
+        VideoJob *job = take_free_job(session);
+        int64_t start = metrics_now();
+        if (!read_dirty_rects(input, job, format)) {
+          session->spareJob = job;
+          return 0;
+        }
+        metrics_record_since(metrics.read, start);
+        job->type = JOB_DIRTY_RECTS;
+        job->pts = (int64_t)header.pts;
+        job->deadline = av_gettime();
+        queue_job(pipeline, job);
+      } else if (strncmp(header.command, "BLR\n", 4) == 0) {
+        VideoJob *job = take_free_job(session);
+        if (!read_blur(input, job, format)) {
+          session->spareJob = job;
+          return 0;
+        }
+        job->type = JOB_BLUR;
+        job->pts = (int64_t)header.pts;
+        job->deadline = av_gettime();
+        queue_job(pipeline, job);
+      } else if (strncmp(header.command, "CFG\n", 4) == 0 ||
+                 strncmp(header.command, "STR\n", 4) == 0) {
+        // Either way the pictures are laid out differently from now on.
+        int config = header.command[0] == 'C';
+        if (config ? !read_config(input, format) : !read_stride(input, format)) {
+          return 0;
+        }
+        if (shmRing) shm_ring_check(input_picture_size(format));
+
+        VideoJob *job = take_free_job(session);
+        prepare_job_picture(job, format);
+        job->type = config ? JOB_CONFIG : JOB_STRIDE;
+        job->pts = (int64_t)header.pts;
+        job->deadline = av_gettime();
+        queue_job(pipeline, job);
+      } else if (strncmp(header.command, "ADD\n", 4) == 0 ||
+                 strncmp(header.command, "DEL\n", 4) == 0) {
+        DestinationData destination;
+        if (fread(&destination, sizeof(destination), 1, input) != 1) {
+          perror("unable to read destination");
+          return 0;
+        }
+        char host[sizeof(destination.host) + 1] = {0};
+        memcpy(host, destination.host, sizeof(destination.host));
+        char port[8];
+        snprintf(port, sizeof(port), "%u", destination.port);
+
+        // A bad destination only concerns its own viewer, keep going.
+        if (header.command[0] == 'A') {
+          udp_output_add(pipeline->udpOutput, host, port);
+        } else if (!udp_output_remove(pipeline->udpOutput, host, port)) {
+          fprintf(stderr, "unknown destination: %s:%s\n", host, port);
+        }
+      } else if (strncmp(header.command, "BRT\n", 4) == 0) {
+        uint32_t kbps = 0;
+        if (fread(&kbps, sizeof(kbps), 1, input) != 1) {
+          perror("unable to read bitrate");
+          return 0;
+        }
+        if (!maxBitrate) {
+          // x264 cannot turn the VBV on once it is running.
+          fprintf(stderr, "bitrate control is not enabled, use -b\n");
+          return 0;
+        }
+        if (kbps == 0) {
+          fprintf(stderr, "invalid bitrate: %u\n", kbps);
+          return 0;
+        }
+        __atomic_store_n(&pipeline->targetBitrate, kbps, __ATOMIC_RELAXED);
+      } else if (strncmp(header.command, "AUD\n", 4) == 0) {
+        uint32_t inputSamples = 0;
+        if (fread(&inputSamples, sizeof(inputSamples), 1, input) == 1) {
+          if (!pipeline->aCodecCtx) {
+            fprintf(stderr, "audio is not enabled\n");
+            return 0;
+          }
+          uint32_t readSamples = 0;
+          while (inputSamples > 0) {
+            if (session->audioSamples == 0) {
+              // The buffer starts with the next sample of this command.
+              session->audioBuffer.pts = (int64_t)header.pts +
+                  (int64_t)readSamples * 1000000 / session->sampleRate;
+            }
+            size_t samples = umin(inputSamples, session->audioSamplesMax - session->audioSamples);
+            if (fread(session->audioBuffer.data + (session->audioSamples * session->audioBytesPerSample),
+                session->audioBytesPerSample, samples, input) == samples) {
+              inputSamples -= samples;
+              readSamples += samples;
+              session->audioSamples += samples;
+              if (session->audioSamples == session->audioSamplesMax) {
+                // Hand the full buffer to the audio encoder.
+                spsc_queue_push(&pipeline->audio, &session->audioBuffer);
+                spsc_queue_pop(&pipeline->freeAudio, &session->audioBuffer);
+                session->audioSamples = 0;
+              }
+            } else {
+              perror("unable to read audio data info");
+              return 0;
+            }
           }
         } else {
           perror("unable to read audio sample info");
-          exit(1);
+          return 0;
         }
       } else {
-        fprintf(stderr, "invalid header: %s\n", header.command);
-        exit(1);
+        fprintf(stderr, "invalid header: %.4s\n", header.command);
+        return 0;
       }
+    } else if (feof(input)) {
+      return 1;
     } else {
       perror("unable to read header");
+      return 0;
+    }
+  }
+}
+
+
+/**
+ * Lets every stage finish its work, waits until the last packet is sent
+ * and frees the session. Does not close its input.
+**/
+static void session_close(Session *session) {
+  Pipeline *pipeline = &session->pipeline;
+
+  VideoJob *end = take_free_job(session);
+  end->type = JOB_END;
+  queue_job(pipeline, end);
+  if (pipeline->aCodecCtx) {
+    AudioBuffer endBuffer;
+    memset(&endBuffer, 0, sizeof(endBuffer));
+    spsc_queue_push(&pipeline->audio, &endBuffer);
+  }
+
+  pthread_join(session->converter, NULL);
+  pthread_join(session->encoder, NULL);
+  if (pipeline->aCodecCtx) pthread_join(session->audioEncoder, NULL);
+  pthread_join(session->sender, NULL);
+  udp_output_close(pipeline->udpOutput);
+
+  // Every buffer is back in its free queue, except the ones the end of
+  // input travelled with and the spare job.
+  for (int i = 0; i < VIDEO_JOB_COUNT; ++i) {
+    VideoJob *job = i == 0 ? end : take_free_job(session);
+    av_freep(&job->picture.data[0]);
+    free(job->rects);
+    free(job);
+  }
+  for (int i = 0; i < VIDEO_FRAME_COUNT; ++i) {
+    VideoFrame *frame = NULL;
+    spsc_queue_pop(&pipeline->freeFrames, &frame);
+    if (frame->frame) free_video_frame(frame->frame);
+    free(frame->bandVersions);
+    free(frame);
+  }
+  spsc_queue_destroy(&pipeline->jobs);
+  spsc_queue_destroy(&pipeline->freeJobs);
+  sem_destroy(&pipeline->jobsReady);
+  pthread_mutex_destroy(&pipeline->latestFrameMutex);
+  spsc_queue_destroy(&pipeline->frames);
+  spsc_queue_destroy(&pipeline->freeFrames);
+  spsc_queue_destroy(&pipeline->videoPackets);
+  spsc_queue_destroy(&pipeline->audioPackets);
+  sem_destroy(&pipeline->packetsReady);
+
+  if (pipeline->aCodecCtx) {
+    free(session->audioBuffer.data);
+    for (int i = 1; i < AUDIO_BUFFER_COUNT; ++i) {
+      AudioBuffer buffer;
+      spsc_queue_pop(&pipeline->freeAudio, &buffer);
+      free(buffer.data);
+    }
+    spsc_queue_destroy(&pipeline->audio);
+    spsc_queue_destroy(&pipeline->freeAudio);
+
+    if (pipeline->audioFrame) {
+      av_freep(&pipeline->audioFrame->data[0]);
+      avcodec_free_frame(&pipeline->audioFrame);
+    }
+    swr_free(&pipeline->resampler);
+  }
+  close_output(pipeline->outputContext);
+  free(session);
+}
+
+
+/**
+ * Serves one `-S` connection: a `SES\n` command with the parameters of the
+ * session, then the same commands as the standard in pipe.
+**/
+static void *serve_thread(void *arg) {
+  FILE *input = arg;
+  Session *session = NULL;
+
+  CommandData header;
+  SessionData parameters;
+  if (fread(&header, sizeof(header), 1, input) != 1 ||
+      strncmp(header.command, "SES\n", 4) != 0 ||
+      fread(&parameters, sizeof(parameters), 1, input) != 1) {
+    fprintf(stderr, "expected a session header\n");
+  } else {
+    char host[sizeof(parameters.destination.host) + 1] = {0};
+    memcpy(host, parameters.destination.host, sizeof(parameters.destination.host));
+    char port[8];
+    snprintf(port, sizeof(port), "%u", parameters.destination.port);
+    char pixelFormat[sizeof(parameters.config.pixelFormat) + 1] = {0};
+    memcpy(pixelFormat, parameters.config.pixelFormat, sizeof(parameters.config.pixelFormat));
+    char audioFormat[sizeof(parameters.audioFormat) + 1] = {0};
+    memcpy(audioFormat, parameters.audioFormat, sizeof(parameters.audioFormat));
+
+    InputFormat format;
+    memset(&format, 0, sizeof(format));
+    if (parse_input_format(&format, parameters.config.width,
+                           parameters.config.height, pixelFormat)) {
+      session = session_open(input, &format, audioFormat[0] ? audioFormat : NULL,
+                             (int)parameters.sampleRate, host, port, NULL, 0);
+    }
+  }
+
+  if (session) {
+    // A malformed command only ends its own session.
+    if (!read_commands(session)) {
+      fprintf(stderr, "closing session after an invalid command\n");
+    }
+    session_close(session);
+  }
+  fclose(input);
+  return NULL;
+}
+
+
+static const char *socketPath = NULL;
+
+static void remove_socket(void) {
+  unlink(socketPath);
+}
+
+
+/**
+ * Accepts connections on the Unix socket `path`, one session each.
+**/
+static void serve(const char *path) __attribute__ ((noreturn));
+static void serve(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+
+  // Only replace a socket left behind by a previous server.
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perror("unable to listen on socket");
+    exit(1);
+  }
+  socketPath = path;
+  atexit(remove_socket);
+
+  while (1) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("unable to accept connection");
       exit(1);
     }
+
+    FILE *input = fdopen(fd, "rb");
+    if (!input) {
+      perror("unable to open connection");
+      close(fd);
+      continue;
+    }
+    pthread_t thread;
+    start_thread(&thread, serve_thread, input);
+    pthread_detach(thread);
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  const char *shmName = NULL;
+  const char *serverPath = NULL;
+  const char *statsPath = NULL;
+  char **destinations = calloc((size_t)argc, sizeof(char *));
+  int destinationCount = 0;
+
+  // Parse options, positional parameters follow them.
+  int opt;
+  while ((opt = getopt(argc, argv, "m:g:r:s:b:B:cp:KA:d:S:M:")) != -1) {
+    switch (opt) {
+      case 'm':
+        shmName = optarg;
+        break;
+      case 'g':
+        refreshPeriod = atoi(optarg);
+        if (refreshPeriod < 0) usage(argv[0]);
+        break;
+      case 'r':
+        frameRate = atoi(optarg);
+        if (frameRate <= 0) usage(argv[0]);
+        break;
+      case 's':
+        conversionSlices = atoi(optarg);
+        if (conversionSlices < 0) usage(argv[0]);
+        break;
+      case 'b':
+        maxBitrate = atoi(optarg);
+        if (maxBitrate <= 0) usage(argv[0]);
+        break;
+      case 'B':
+        vbvBufferSize = atoi(optarg);
+        if (vbvBufferSize <= 0) usage(argv[0]);
+        break;
+      case 'c':
+        constantBitrate = 1;
+        break;
+      case 'p':
+        pacingInterval = atoll(optarg);
+        if (pacingInterval < 0) usage(argv[0]);
+        break;
+      case 'd':
+        if (!strrchr(optarg, ':')) usage(argv[0]);
+        destinations[destinationCount++] = optarg;
+        break;
+      case 'S':
+        serverPath = optarg;
+        break;
+      case 'K':
+        keepAllFrames = 1;
+        break;
+      case 'A':
+        if (strcmp(optarg, "aac") == 0) {
+          opusAudio = 0;
+        } else if (strncmp(optarg, "opus", 4) == 0) {
+          opusAudio = 1;
+          if (optarg[4] == ':') {
+            opusFrameDuration = optarg + 5;
+          } else if (optarg[4] != '\0') {
+            usage(argv[0]);
+          }
+          // Frames libopus accepts that are not longer than AAC ones.
+          if (strcmp(opusFrameDuration, "2.5") != 0 && strcmp(opusFrameDuration, "5") != 0 &&
+              strcmp(opusFrameDuration, "10") != 0 && strcmp(opusFrameDuration, "20") != 0) {
+            usage(argv[0]);
+          }
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'M':
+        statsPath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  // Check for parameters, sessions of a server bring their own.
+  char **args = argv + optind;
+  int nargs = argc - optind;
+  if (serverPath) {
+    if (nargs != 0 || shmName || destinationCount > 0) {
+      usage(argv[0]);
+    }
+  } else if (nargs != 5 && nargs != 7) {
+    usage(argv[0]);
+  }
+  if (!maxBitrate && (vbvBufferSize || constantBitrate)) {
+    usage(argv[0]);
+  }
+  if (maxBitrate && !vbvBufferSize) {
+    // One frame at the nominal rate, anything larger adds latency.
+    vbvBufferSize = (maxBitrate + frameRate - 1) / frameRate;
+  }
+
+  // Close all file descriptors except the standard ones
+  // This avoids conflitcs between parent context and this one.
+  for (int i = STDERR_FILENO + 1; i < MAX_FDS_OPEN; ++i) {
+    close(i);
+  }
+
+  // Register a few signals to avoid blocking forever.
+  signal(SIGINT, sigterm_handler);
+  signal(SIGTERM, sigterm_handler);
+
+  color_convert_init(NULL);
+
+  // Register all formats and codecs
+  av_register_all();
+  avformat_network_init();
+
+  atexit(print_stats);
+  register_metrics();
+  if (statsPath) {
+    metrics_start(statsPath);
+  }
+
+  if (serverPath) {
+    // One worker per core converts and encodes for every session.
+    WorkerPool pool;
+    worker_pool_init(&pool, av_cpu_count(), 0);
+    sharedPool = &pool;
+    serve(serverPath);
+  }
+
+  InputFormat input;
+  memset(&input, 0, sizeof(input));
+  if (!parse_input_format(&input, (uint32_t)atoi(args[2]), (uint32_t)atoi(args[3]), args[4])) {
+    return 1;
+  }
+  if (shmName) {
+    shm_ring_open(shmName, input_picture_size(&input));
+  }
+
+  Session *session = session_open(stdin, &input, nargs == 7 ? args[5] : NULL,
+                                  nargs == 7 ? atoi(args[6]) : 0,
+                                  args[0], args[1], destinations, destinationCount);
+  if (!session) {
+    return 1;
+  }
+  if (!read_commands(session)) {
+    exit(1);
   }
+  session_close(session);
+  return 0;
 }
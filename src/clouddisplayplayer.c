@@ -28,23 +28,45 @@
 #include <assert.h>
 
 #include <libavutil/opt.h>
+#include <libavutil/time.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
 #include <SDL.h>
-#include <SDL_thread.h>
-#include <SDL_syswm.h>
 
 #include <stdio.h>
 
+#include "metrics.h"
+
 #define MAX_FDS_OPEN 512
 
 #define CLOUDDISPLAY_RESIZE_EVENT  (SDL_USEREVENT + 2)
 
-#define SDL_AUDIO_BUFFER_SIZE 1024
+// Milliseconds of audio in the SDL device buffer at most, every one of them
+// is added to the audio latency.
+#define SDL_AUDIO_BUFFER_MS 10
 #define MAX_AUDIO_FRAME_SIZE 288000
+// Preallocated audio packets, larger ones are dropped. AAC and Opus
+// packets of the encoder are a few hundred bytes.
+#define AUDIO_PACKET_COUNT 16
+#define AUDIO_PACKET_MAX_SIZE 8192
+// Queued audio packets beyond which the oldest are dropped to catch up.
+// The rest of the ring keeps the receive thread off the packet being read.
+#define AUDIO_QUEUE_MAX_PACKETS 8
+
+// Bytes of video packets waiting for the decoder at most, about half a
+// second of 1080p intra frames. Beyond them the queue is flushed up to the
+// next keyframe, see `packet_queue_put()`.
+#define VIDEO_QUEUE_MAX_BYTES (4 * 1024 * 1024)
+
+// Decoded frames waiting for the presentation thread. Only the newest is
+// presented, so this only bounds how many are decoded ahead of it.
+#define FRAME_QUEUE_SIZE 3
+// How long the presentation thread waits for a frame before it handles
+// the cursor and the events anyway.
+#define PRESENT_POLL_MS 10
 
 
 #pragma pack(push)
@@ -70,11 +92,43 @@ typedef struct PacketQueue {
   AVPacketList *start, *end;
   int count;
   int size; // sum of sizes for all packets.
+  int maxSize;
+  int waitForKeyframe; // set by a flush, packets are dropped until a keyframe
   SDL_mutex *mutex;
   SDL_cond *cond;
+  MetricsGauge *countGauge;
+  MetricsGauge *sizeGauge;
+  MetricsCounter *droppedCounter;
 } PacketQueue;
 
-static PacketQueue audioQueue;
+// Decoded frames, oldest first. A frame pushed into a full queue drops
+// the oldest one, so the decoder never waits on the presentation.
+typedef struct {
+  AVFrame *frames[FRAME_QUEUE_SIZE];
+  int start;
+  int count;
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+} FrameQueue;
+
+// Payload of an audio packet, copied out of the demuxer's.
+typedef struct {
+  uint32_t sequence; // odd while the receive thread writes the packet
+  int size;
+  uint8_t data[AUDIO_PACKET_MAX_SIZE];
+} AudioPacket;
+
+// Audio packets from the receive thread to the audio callback. Neither
+// side ever waits for the other: the receive thread overwrites the oldest
+// packet when the ring is full, and the callback copies a packet out and
+// checks its sequence to find out whether it was overwritten meanwhile.
+static struct {
+  AudioPacket *packets; // AUDIO_PACKET_COUNT
+  uint64_t head; // packets written, only written by the receive thread
+  uint64_t tail; // packets read or dropped, only written by the callback
+} audioRing;
+static PacketQueue videoQueue;
+static FrameQueue videoFrames;
 
 static AVFormatContext *formatCtx = NULL;
 
@@ -93,14 +147,74 @@ static PositionData currentPosition;
 static SDL_mutex *mouseMutex = NULL;
 static MouseData currentMouse;
 
-
-static void packet_queue_init(PacketQueue *q) {
+// Capture-to-display latency of every frame, see `log_latency()`.
+static FILE *latencyLog = NULL;
+
+// Stage timings written by `-M`, registered by `register_metrics()`.
+static struct {
+  MetricsHistogram *receive;
+  MetricsHistogram *decode;
+  MetricsHistogram *upload;
+  MetricsHistogram *display;
+  MetricsHistogram *latency; // capture to display
+  MetricsCounter *framesDisplayed;
+  MetricsCounter *framesDropped; // decoded but never displayed
+  MetricsCounter *audioPacketsDropped;
+  MetricsGauge *audioQueuePackets;
+  MetricsGauge *audioQueueBytes;
+} metrics;
+
+
+static void packet_queue_init(PacketQueue *q, int maxSize, const char *countName,
+                              const char *sizeName, const char *droppedName) {
   memset(q, 0, sizeof(PacketQueue));
+  q->maxSize = maxSize;
   q->mutex = SDL_CreateMutex();
   q->cond = SDL_CreateCond();
+  q->countGauge = metrics_gauge(countName);
+  q->sizeGauge = metrics_gauge(sizeName);
+  q->droppedCounter = metrics_counter(droppedName);
+}
+
+/**
+ * Frees every queued packet, with the mutex held.
+**/
+static void packet_queue_flush(PacketQueue *q) {
+  while (q->start) {
+    AVPacketList *node = q->start;
+    q->start = node->next;
+    av_free_packet(&node->pkt);
+    av_free(node);
+  }
+  q->end = NULL;
+  metrics_add(q->droppedCounter, (uint64_t)q->count);
+  q->count = 0;
+  q->size = 0;
+  metrics_set(q->countGauge, 0);
+  metrics_set(q->sizeGauge, 0);
 }
 
+/**
+ * Queues `pkt`, or frees it. When the queued packets would exceed
+ * `maxSize` bytes, which only happens when the decoder falls behind, they
+ * are all dropped, and so is every following packet until a keyframe the
+ * decoder can start over from.
+**/
 static void packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+  SDL_LockMutex(q->mutex);
+  if (q->size + pkt->size > q->maxSize) {
+    packet_queue_flush(q);
+    q->waitForKeyframe = 1;
+  }
+  if (q->waitForKeyframe && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+    SDL_UnlockMutex(q->mutex);
+    metrics_add(q->droppedCounter, 1);
+    av_free_packet(pkt);
+    return;
+  }
+  q->waitForKeyframe = 0;
+  SDL_UnlockMutex(q->mutex);
+
   // Duplicate packet if needed.
   if (av_dup_packet(pkt) < 0) {
     fprintf(stderr, "could not set duplicate packet\n");
@@ -122,6 +236,8 @@ static void packet_queue_put(PacketQueue *q, AVPacket *pkt) {
   q->end = node;
   q->count++;
   q->size += pkt->size;
+  metrics_set(q->countGauge, q->count);
+  metrics_set(q->sizeGauge, q->size);
   SDL_CondSignal(q->cond);
 
   SDL_UnlockMutex(q->mutex);
@@ -138,6 +254,8 @@ static void packet_queue_get(PacketQueue *q, AVPacket *pkt) {
 
       q->count--;
       q->size -= node->pkt.size;
+      metrics_set(q->countGauge, q->count);
+      metrics_set(q->sizeGauge, q->size);
 
       *pkt = node->pkt;
       av_free(node);
@@ -151,6 +269,165 @@ static void packet_queue_get(PacketQueue *q, AVPacket *pkt) {
 }
 
 
+static void frame_queue_init(FrameQueue *q) {
+  memset(q, 0, sizeof(FrameQueue));
+  for (int i = 0; i < FRAME_QUEUE_SIZE; ++i) {
+    q->frames[i] = av_frame_alloc();
+    if (!q->frames[i]) {
+      fprintf(stderr, "could not allocate video frame\n");
+      exit(1);
+    }
+  }
+  q->mutex = SDL_CreateMutex();
+  q->cond = SDL_CreateCond();
+}
+
+/**
+ * Moves the reference of `frame` into the queue, dropping the oldest
+ * queued frame if it is full.
+**/
+static void frame_queue_push(FrameQueue *q, AVFrame *frame) {
+  SDL_LockMutex(q->mutex);
+
+  if (q->count == FRAME_QUEUE_SIZE) {
+    av_frame_unref(q->frames[q->start]);
+    q->start = (q->start + 1) % FRAME_QUEUE_SIZE;
+    q->count--;
+    metrics_add(metrics.framesDropped, 1);
+  }
+  av_frame_move_ref(q->frames[(q->start + q->count) % FRAME_QUEUE_SIZE], frame);
+  q->count++;
+  SDL_CondSignal(q->cond);
+
+  SDL_UnlockMutex(q->mutex);
+}
+
+/**
+ * Moves the newest queued frame into `frame` and drops the older ones.
+ * Waits up to `timeoutMs` for one, returns 0 if none came.
+**/
+static int frame_queue_take_newest(FrameQueue *q, AVFrame *frame, Uint32 timeoutMs) {
+  SDL_LockMutex(q->mutex);
+
+  if (q->count == 0) {
+    SDL_CondWaitTimeout(q->cond, q->mutex, timeoutMs);
+  }
+  int taken = q->count > 0;
+  if (taken) {
+    for (int i = 0; i < q->count - 1; ++i) {
+      av_frame_unref(q->frames[(q->start + i) % FRAME_QUEUE_SIZE]);
+    }
+    metrics_add(metrics.framesDropped, (uint64_t)(q->count - 1));
+    av_frame_move_ref(frame, q->frames[(q->start + q->count - 1) % FRAME_QUEUE_SIZE]);
+    q->start = 0;
+    q->count = 0;
+  }
+
+  SDL_UnlockMutex(q->mutex);
+  return taken;
+}
+
+
+static void audio_queue_init(void) {
+  audioRing.packets = calloc(AUDIO_PACKET_COUNT, sizeof(AudioPacket));
+  if (!audioRing.packets) {
+    fprintf(stderr, "could not allocate audio packets\n");
+    exit(1);
+  }
+}
+
+
+/**
+ * Sets the audio gauges to the packets between `tail` and `head`, as far
+ * as they are still in the ring.
+**/
+static void audio_queue_measure(uint64_t head, uint64_t tail) {
+  uint64_t count = head - tail < AUDIO_PACKET_COUNT ? head - tail : AUDIO_PACKET_COUNT;
+  int64_t bytes = 0;
+  for (uint64_t i = head - count; i != head; ++i) {
+    bytes += __atomic_load_n(&audioRing.packets[i % AUDIO_PACKET_COUNT].size, __ATOMIC_RELAXED);
+  }
+  metrics_set(metrics.audioQueuePackets, (int64_t)count);
+  metrics_set(metrics.audioQueueBytes, bytes);
+}
+
+
+/**
+ * Queues a copy of `pkt` for the audio callback, from the receive thread.
+ * Never waits: the oldest packet is overwritten when the ring is full,
+ * even if the callback is reading it, see `audio_queue_get()`.
+**/
+static void audio_queue_put(const AVPacket *pkt) {
+  if (pkt->size > AUDIO_PACKET_MAX_SIZE) {
+    metrics_add(metrics.audioPacketsDropped, 1);
+    return;
+  }
+  uint64_t head = audioRing.head;
+  AudioPacket *packet = &audioRing.packets[head % AUDIO_PACKET_COUNT];
+  uint32_t sequence = packet->sequence;
+  __atomic_store_n(&packet->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(packet->data, pkt->data, (size_t)pkt->size);
+  __atomic_store_n(&packet->size, pkt->size, __ATOMIC_RELAXED);
+  __atomic_store_n(&packet->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&audioRing.head, head + 1, __ATOMIC_RELEASE);
+  audio_queue_measure(head + 1, __atomic_load_n(&audioRing.tail, __ATOMIC_RELAXED));
+}
+
+
+/**
+ * Copies the next audio packet into `data` from the audio callback and
+ * returns its size, -1 if there is none. Never waits: when more than
+ * `AUDIO_QUEUE_MAX_PACKETS` are queued the oldest are dropped, so the audio
+ * latency stays bounded, and a packet overwritten while it was copied is
+ * dropped as well.
+**/
+static int audio_queue_get(uint8_t *data) {
+  while (1) {
+    uint64_t head = __atomic_load_n(&audioRing.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = audioRing.tail;
+    if (head - tail > AUDIO_QUEUE_MAX_PACKETS) {
+      metrics_add(metrics.audioPacketsDropped, head - tail - AUDIO_QUEUE_MAX_PACKETS);
+      tail = head - AUDIO_QUEUE_MAX_PACKETS;
+    }
+    if (tail == head) {
+      __atomic_store_n(&audioRing.tail, tail, __ATOMIC_RELAXED);
+      audio_queue_measure(head, tail);
+      return -1;
+    }
+
+    AudioPacket *packet = &audioRing.packets[tail % AUDIO_PACKET_COUNT];
+    uint32_t sequence = __atomic_load_n(&packet->sequence, __ATOMIC_ACQUIRE);
+    int size = __atomic_load_n(&packet->size, __ATOMIC_RELAXED);
+    memcpy(data, packet->data, (size_t)size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    __atomic_store_n(&audioRing.tail, tail + 1, __ATOMIC_RELAXED);
+    // Neither being written nor rewritten since, nor a lap ahead already.
+    if ((sequence & 1) == 0 && __atomic_load_n(&packet->sequence, __ATOMIC_RELAXED) == sequence &&
+        __atomic_load_n(&audioRing.head, __ATOMIC_RELAXED) - tail <= AUDIO_PACKET_COUNT) {
+      memset(data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+      audio_queue_measure(head, tail + 1);
+      return size;
+    }
+    metrics_add(metrics.audioPacketsDropped, 1);
+  }
+}
+
+
+static void register_metrics(void) {
+  metrics.receive = metrics_histogram("receive");
+  metrics.decode = metrics_histogram("decode");
+  metrics.upload = metrics_histogram("upload");
+  metrics.display = metrics_histogram("display");
+  metrics.latency = metrics_histogram("latency");
+  metrics.framesDisplayed = metrics_counter("frames_displayed");
+  metrics.framesDropped = metrics_counter("frames_dropped");
+  metrics.audioPacketsDropped = metrics_counter("audio_packets_dropped");
+  metrics.audioQueuePackets = metrics_gauge("audio_queue_packets");
+  metrics.audioQueueBytes = metrics_gauge("audio_queue_bytes");
+}
+
+
 static void sigterm_handler(int sig) __attribute__ ((noreturn));
 static void sigterm_handler(int sig) {
   (void)sig; // Supress unused warning.
@@ -199,141 +476,255 @@ static int command_thread(void *data) {
 }
 
 
-static void decodeAndDisplayStream() {
-  int frameFinished;
+/**
+ * Capture time in microseconds of a video frame with timestamp `pts`. The
+ * stream only carries it modulo the timestamp wrap period (26.5 hours at
+ * 90 kHz), so this takes the one closest to `now`. Both clocks must be in
+ * sync for the result to mean anything.
+**/
+static int64_t capture_time(int64_t pts, int64_t now) {
+  AVStream *stream = formatCtx->streams[videoStream];
+  int64_t wrap = 1LL << stream->pts_wrap_bits;
+  int64_t elapsed = (av_rescale_q(now, AV_TIME_BASE_Q, stream->time_base) - pts) % wrap;
+  if (elapsed < 0) elapsed += wrap;
+  // Past half the period the capture clock is ahead of ours.
+  if (elapsed > wrap / 2) elapsed -= wrap;
+  return now - av_rescale_q(elapsed, stream->time_base, AV_TIME_BASE_Q);
+}
 
-  AVPacket packet;
-  AVFrame *frame = NULL;
-  struct SwsContext *swsCtx = NULL;
 
-  SDL_Overlay *overlay = NULL;
-  SDL_Surface *screen = NULL;
-  SDL_Surface *cursor_image = NULL;
-  SDL_Rect rect;
-  SDL_Event event;
-  PositionData position;
-  char buffer[1024];
+/**
+ * Writes the capture time and capture-to-display latency of a frame just
+ * displayed, both in microseconds.
+**/
+static void log_latency(const AVFrame *frame) {
+  int64_t pts = av_frame_get_best_effort_timestamp(frame);
+  if (pts == AV_NOPTS_VALUE) return;
+
+  int64_t now = av_gettime();
+  int64_t captured = capture_time(pts, now);
+  metrics_record(metrics.latency, (now - captured) * 1000);
+  if (latencyLog) {
+    fprintf(latencyLog, "%lld %lld\n", (long long)captured, (long long)(now - captured));
+  }
+}
 
-  // Grab the position.
-  SDL_mutexP(positionMutex);
-  position = currentPosition;
-  SDL_mutexV(positionMutex);
 
-  cursor_image = SDL_LoadBMP("cursor.bmp");
-  if (!cursor_image) {
-    fprintf(stderr, "could not load cursor image: %s\n", SDL_GetError());
+/**
+ * Receive thread. Reads the stream as fast as it arrives so the socket
+ * buffer never overflows, and hands the packets to their decoders.
+**/
+static int receive_thread(void *data) {
+  (void)data; // Supress unused warning.
+
+  AVPacket packet;
+  int64_t start = metrics_now();
+  while (av_read_frame(formatCtx, &packet) >= 0) {
+    start = metrics_record_since(metrics.receive, start);
+
+    if (packet.stream_index == videoStream) {
+      packet_queue_put(&videoQueue, &packet);
+    } else if (packet.stream_index == audioStream) {
+      audio_queue_put(&packet);
+      av_free_packet(&packet);
+    } else {
+      av_free_packet(&packet);
+    }
   }
+  return 0;
+}
 
-  memset(buffer, 0, sizeof(buffer));
-  snprintf(buffer, sizeof(buffer), "%i,%i", position.x, position.y);
-  setenv("SDL_VIDEO_WINDOW_POS", buffer, 1);
 
-  // Make a screen to put our video
-  screen = SDL_SetVideoMode(position.width, position.height, 0,
-    SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL | SDL_NOFRAME);
+/**
+ * Video decode thread. Decodes every packet, presented or not, since the
+ * frames that follow depend on it.
+**/
+static int decode_thread(void *data) {
+  (void)data; // Supress unused warning.
 
-#ifdef __linux__
-  SDL_SysWMinfo SysInfo;
-  SDL_VERSION(&SysInfo.version);
-  if (SDL_GetWMInfo(&SysInfo) <= 0) {
-    fprintf(stderr, "unable to get window info: %s\n", SDL_GetError());
+  AVPacket packet;
+  AVFrame *frame = av_frame_alloc();
+  if (!frame) {
+    fprintf(stderr, "could not allocate video frame\n");
     exit(1);
   }
 
-  SysInfo.info.x11.lock_func();
-  XRaiseWindow(SysInfo.info.x11.display, SysInfo.info.x11.wmwindow);
-  SysInfo.info.x11.unlock_func();
-#endif
+  while (1) {
+    packet_queue_get(&videoQueue, &packet);
+
+    int frameFinished = 0;
+    int64_t start = metrics_now();
+    avcodec_decode_video2(vCodecCtx, frame, &frameFinished, &packet);
+    metrics_record_since(metrics.decode, start);
+    if (frameFinished) {
+      frame_queue_push(&videoFrames, frame);
+    }
 
-  if (!screen) {
-    fprintf(stderr, "could not set video mode: %s\n", SDL_GetError());
+    // Free the packet that was allocated by av_read_frame
+    av_free_packet(&packet);
+  }
+  return 0;
+}
+
+
+/**
+ * Creates the renderer of `window`, on the GPU when there is one.
+**/
+static SDL_Renderer *create_renderer(SDL_Window *window) {
+  SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  if (!renderer) {
+    fprintf(stderr, "no accelerated renderer, falling back to software: %s\n", SDL_GetError());
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+  }
+  if (!renderer) {
+    fprintf(stderr, "could not create renderer: %s\n", SDL_GetError());
     exit(1);
   }
+  return renderer;
+}
 
-  // Allocate a place to put our YUV image on that screen
-  overlay = SDL_CreateYUVOverlay(position.width, position.height, SDL_YV12_OVERLAY, screen);
+
+/**
+ * Uploads the planes of `frame` into `texture`, which the renderer scales
+ * to the window. Frames that are not YUV420P, which the encoder never
+ * sends, are converted into `converted` first, allocated for the size of
+ * `frame` unless it already is.
+**/
+static void upload_frame(SDL_Texture *texture, const AVFrame *frame,
+                         struct SwsContext **swsCtx, AVPicture *converted) {
+  const uint8_t *const *data = (const uint8_t *const *)frame->data;
+  const int *linesize = frame->linesize;
+
+  if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+    if (!converted->data[0] &&
+        avpicture_alloc(converted, AV_PIX_FMT_YUV420P, frame->width, frame->height) < 0) {
+      fprintf(stderr, "could not allocate conversion buffer\n");
+      exit(1);
+    }
+    *swsCtx = sws_getCachedContext(*swsCtx, frame->width, frame->height, frame->format,
+                                   frame->width, frame->height, AV_PIX_FMT_YUV420P,
+                                   SWS_BILINEAR, NULL, NULL, NULL);
+    if (!*swsCtx) {
+      fprintf(stderr, "could not initialize the conversion context\n");
+      exit(1);
+    }
+    sws_scale(*swsCtx, data, linesize, 0, frame->height, converted->data, converted->linesize);
+    data = (const uint8_t *const *)converted->data;
+    linesize = converted->linesize;
+  }
+
+  if (SDL_UpdateYUVTexture(texture, NULL, data[0], linesize[0], data[1], linesize[1],
+                           data[2], linesize[2]) < 0) {
+    fprintf(stderr, "could not update texture: %s\n", SDL_GetError());
+  }
+}
+
+
+/**
+ * Presentation loop, run on the main thread from the first `POS\n` on.
+ * Shows the newest decoded frame, draws the cursor and handles the events.
+ * Later `POS\n` commands move and resize the window in place: the texture
+ * keeps the stream size and the renderer scales it to any window size.
+**/
+static void decodeAndDisplayStream(void) __attribute__ ((noreturn));
+static void decodeAndDisplayStream(void) {
+  AVFrame *frame = NULL;
+  struct SwsContext *swsCtx = NULL;
+  AVPicture converted;
+  memset(&converted, 0, sizeof(converted));
+
+  SDL_Window *window = NULL;
+  SDL_Renderer *renderer = NULL;
+  SDL_Texture *texture = NULL;
+  int textureWidth = 0;
+  int textureHeight = 0;
+  SDL_Texture *cursorTexture = NULL;
+  SDL_Rect cursorRect;
+  SDL_Event event;
+  PositionData position;
+  MouseData shownMouse;
+
+  // Grab the position.
+  SDL_mutexP(positionMutex);
+  position = currentPosition;
+  SDL_mutexV(positionMutex);
+
+  window = SDL_CreateWindow("clouddisplayplayer", position.x, position.y,
+                            position.width, position.height, SDL_WINDOW_BORDERLESS);
+  if (!window) {
+    fprintf(stderr, "could not create window: %s\n", SDL_GetError());
+    exit(1);
+  }
+  SDL_RaiseWindow(window);
+  renderer = create_renderer(window);
+
+  SDL_Surface *cursor_image = SDL_LoadBMP("cursor.bmp");
+  if (cursor_image) {
+    cursorTexture = SDL_CreateTextureFromSurface(renderer, cursor_image);
+    cursorRect.w = cursor_image->w;
+    cursorRect.h = cursor_image->h;
+    SDL_FreeSurface(cursor_image);
+  }
+  if (!cursorTexture) {
+    fprintf(stderr, "could not load cursor image: %s\n", SDL_GetError());
+  }
+  memset(&shownMouse, 0, sizeof(shownMouse));
 
   // Allocate video frame
-  frame = avcodec_alloc_frame();
-
-  swsCtx = sws_getContext(
-    vCodecCtx->width,
-    vCodecCtx->height,
-    vCodecCtx->pix_fmt,
-    position.width,
-    position.height,
-    PIX_FMT_YUV420P,
-    SWS_BILINEAR,
-    NULL,
-    NULL,
-    NULL
-  );
+  frame = av_frame_alloc();
 
-  while (av_read_frame(formatCtx, &packet) >= 0) {
-    // Is this a packet from the video stream?
-    if (packet.stream_index == videoStream) {
-      // Decode video frame
-      avcodec_decode_video2(vCodecCtx, frame, &frameFinished, &packet);
-
-      // Did we get a video frame?
-      if (frameFinished) {
-        SDL_LockYUVOverlay(overlay);
-
-        AVPicture pict;
-        pict.data[0] = overlay->pixels[0];
-        pict.data[1] = overlay->pixels[2];
-        pict.data[2] = overlay->pixels[1];
-
-        pict.linesize[0] = overlay->pitches[0];
-        pict.linesize[1] = overlay->pitches[2];
-        pict.linesize[2] = overlay->pitches[1];
-
-        // Convert the image into YUV format that SDL uses
-        sws_scale(
-          swsCtx,
-          (uint8_t const * const *)frame->data,
-          frame->linesize,
-          0,
-          vCodecCtx->height,
-          pict.data,
-          pict.linesize
-        );
-
-        SDL_UnlockYUVOverlay(overlay);
-
-        rect.x = 0;
-        rect.y = 0;
-        rect.w = (uint16_t)position.width;
-        rect.h = (uint16_t)position.height;
-        SDL_DisplayYUVOverlay(overlay, &rect);
+  int dirty = 0;
+  while (1) {
+    if (frame_queue_take_newest(&videoFrames, frame, PRESENT_POLL_MS)) {
+      // The encoder may change resolution mid-stream, the texture follows
+      // the decoded frames and the renderer scales it to the window.
+      if (!texture || frame->width != textureWidth || frame->height != textureHeight) {
+        if (texture) SDL_DestroyTexture(texture);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING,
+                                    frame->width, frame->height);
+        if (!texture) {
+          fprintf(stderr, "could not create texture: %s\n", SDL_GetError());
+          exit(1);
+        }
+        textureWidth = frame->width;
+        textureHeight = frame->height;
+        avpicture_free(&converted);
       }
-      // Free the packet that was allocated by av_read_frame
-      av_free_packet(&packet);
-    } else if (packet.stream_index == audioStream) {
-      packet_queue_put(&audioQueue, &packet);
-    } else {
-      av_free_packet(&packet);
+
+      int64_t start = metrics_now();
+      upload_frame(texture, frame, &swsCtx, &converted);
+      metrics_record_since(metrics.upload, start);
+      dirty = 1;
     }
 
+    MouseData mouse;
+    SDL_mutexP(mouseMutex);
+    mouse = currentMouse;
+    SDL_mutexV(mouseMutex);
     // Only draw mouse if the image was loaded correctly.
-    if (cursor_image) {
-      MouseData mouse;
-      SDL_mutexP(mouseMutex);
-      mouse = currentMouse;
-      SDL_mutexV(mouseMutex);
-
-      if (mouse.flags & 0x01) {
-        SDL_Rect pos;
-        pos.x = (int16_t)mouse.x;
-        pos.y = (int16_t)mouse.y;
-        if (SDL_BlitSurface(cursor_image, NULL, screen, &pos) < 0) {
-          fprintf(stderr, "BlitSurface error: %s\n", SDL_GetError());
-        }
-        SDL_UpdateRect(screen, pos.x, pos.y, cursor_image->w, cursor_image->h);
+    if (cursorTexture && memcmp(&mouse, &shownMouse, sizeof(mouse)) != 0) {
+      shownMouse = mouse;
+      dirty = 1;
+    }
+
+    // The whole picture is drawn again, the cursor leaves no trail.
+    if (dirty && texture) {
+      int64_t start = metrics_now();
+      SDL_RenderCopy(renderer, texture, NULL, NULL);
+      if (cursorTexture && (shownMouse.flags & 0x01)) {
+        cursorRect.x = shownMouse.x;
+        cursorRect.y = shownMouse.y;
+        SDL_RenderCopy(renderer, cursorTexture, NULL, &cursorRect);
       }
-    } else {
-      fprintf(stderr, "cursor image not loaded, skipping mouse positioning\n");
+      SDL_RenderPresent(renderer);
+      if (frame->data[0]) {
+        metrics_record_since(metrics.display, start);
+        metrics_add(metrics.framesDisplayed, 1);
+        log_latency(frame);
+      }
+      dirty = 0;
     }
+    av_frame_unref(frame);
 
     // Drain event pool.
     while (SDL_PollEvent(&event)) {
@@ -342,28 +733,26 @@ static void decodeAndDisplayStream() {
           SDL_Quit();
           exit(0);
         case CLOUDDISPLAY_RESIZE_EVENT:
-          // Push the event again so main-loop can call us again.
-          SDL_PushEvent(&event);
-          goto cleanup;
+          // Several moves may be queued, the latest position is enough.
+          SDL_mutexP(positionMutex);
+          position = currentPosition;
+          SDL_mutexV(positionMutex);
+          SDL_SetWindowPosition(window, position.x, position.y);
+          SDL_SetWindowSize(window, position.width, position.height);
+          // Shown again at the new size right away, from the last frame.
+          dirty = 1;
+          break;
         default:
           break;
       }
     }
   }
-
-cleanup:
-  SDL_FreeYUVOverlay(overlay);
-
-  // Free software scaling context.
-  sws_freeContext(swsCtx);
-
-  // Free the YUV frame
-  av_free(frame);
 }
 
 
 static int audio_decode_frame(uint8_t *audio_buf) {
 
+  static uint8_t packetData[AUDIO_PACKET_MAX_SIZE + FF_INPUT_BUFFER_PADDING_SIZE];
   static AVPacket pkt;
   static uint8_t *audio_pkt_data = NULL;
   static int audio_pkt_size = 0;
@@ -375,6 +764,8 @@ static int audio_decode_frame(uint8_t *audio_buf) {
   while (1) {
     while (audio_pkt_size > 0) {
       int got_frame = 0;
+      pkt.data = audio_pkt_data;
+      pkt.size = audio_pkt_size;
       len1 = avcodec_decode_audio4(aCodecCtx, &frame, &got_frame, &pkt);
       if (len1 < 0) {
         /* if error, skip frame */
@@ -397,13 +788,14 @@ static int audio_decode_frame(uint8_t *audio_buf) {
       return data_size;
     }
 
-    if (pkt.data) {
-      av_free_packet(&pkt);
+    // Nothing queued, the callback plays silence rather than waiting.
+    int size = audio_queue_get(packetData);
+    if (size < 0) {
+      return -1;
     }
-
-    packet_queue_get(&audioQueue, &pkt);
-    audio_pkt_data = pkt.data;
-    audio_pkt_size = pkt.size;
+    av_init_packet(&pkt);
+    audio_pkt_data = packetData;
+    audio_pkt_size = size;
   }
 }
 
@@ -440,14 +832,47 @@ static void audio_pull_from_queue(void *userdata, uint8_t *stream, int len) {
 }
 
 
+static void usage(void) __attribute__ ((noreturn));
+static void usage(void) {
+  fprintf(stderr, "Usage: clouddisplayplayer [-l LATENCY_LOG] [-M STATS_FILE] [-j DECODE_THREADS] [-F] SRC_IP SRC_PORT\n");
+  exit(1);
+}
+
+
 int main(int argc, char *argv[]) {
   char input_str[256] = {0};
   AVDictionary *videoOptionsDict = NULL;
   AVDictionary *audioOptionsDict = NULL;
 
+  const char *latencyPath = NULL;
+  const char *statsPath = NULL;
+  int decodeThreads = 1;
+  int frameThreads = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:M:j:F")) != -1) {
+    switch (opt) {
+      case 'l':
+        latencyPath = optarg;
+        break;
+      case 'M':
+        statsPath = optarg;
+        break;
+      case 'j':
+        decodeThreads = atoi(optarg);
+        if (decodeThreads < 0) usage();
+        break;
+      case 'F':
+        frameThreads = 1;
+        break;
+      default:
+        usage();
+    }
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
   if (argc < 3) {
-    fprintf(stderr, "Usage: clouddisplayplayer SRC_IP SRC_PORT\n");
-    exit(1);
+    usage();
   }
 
   // Close all file descriptors except the standard ones
@@ -455,6 +880,21 @@ int main(int argc, char *argv[]) {
     close(i);
   }
 
+  // Opened before stderr goes away, so failing to do it is reported.
+  if (latencyPath) {
+    latencyLog = fopen(latencyPath, "w");
+    if (!latencyLog) {
+      perror("unable to open latency log");
+      exit(1);
+    }
+    setvbuf(latencyLog, NULL, _IOLBF, 0);
+  }
+
+  register_metrics();
+  if (statsPath) {
+    metrics_start(statsPath);
+  }
+
   // Redirect stdout and stderr to /dev/null.
   {
     int fd = open("/dev/null", O_RDWR);
@@ -476,6 +916,8 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
+  // Same filtering as the bilinear swscale the renderer replaces.
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
 
   // Global position initialization
   memset(&currentPosition, 0, sizeof(currentPosition));
@@ -486,7 +928,7 @@ int main(int argc, char *argv[]) {
   mouseMutex = SDL_CreateMutex();
 
   // Start thread that will read commands from stdin.
-  SDL_CreateThread(command_thread, NULL);
+  SDL_CreateThread(command_thread, "command", NULL);
 
   // Open video stream. Might block.
   snprintf(input_str, sizeof(input_str), "udp://%s:%s", argv[1], argv[2]);
@@ -526,6 +968,20 @@ int main(int argc, char *argv[]) {
     return -1; // Codec not found
   }
 
+  // Decoded frames are queued for the presentation thread, so they must
+  // outlive the next decoding call.
+  vCodecCtx->refcounted_frames = 1;
+
+  // Slice threads decode the slices of a frame in parallel without delay.
+  // Frame threads hold back a frame per thread, so they are opt-in.
+  vCodecCtx->thread_count = decodeThreads;
+  if (frameThreads) {
+    vCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  } else {
+    vCodecCtx->thread_type = FF_THREAD_SLICE;
+    vCodecCtx->flags |= CODEC_FLAG_LOW_DELAY;
+  }
+
   // Open video codec
   if (avcodec_open2(vCodecCtx, vCodec, &videoOptionsDict) < 0) {
     fprintf(stderr, "unable to open video codec\n");
@@ -549,6 +1005,10 @@ int main(int argc, char *argv[]) {
 
     swrCtx = swr_alloc();
 
+    // Opus streams only tell their channel count.
+    if (!aCodecCtx->channel_layout) {
+      aCodecCtx->channel_layout = (uint64_t)av_get_default_channel_layout(aCodecCtx->channels);
+    }
     av_opt_set_int(swrCtx, "in_channel_layout", aCodecCtx->channel_layout, 0);
     av_opt_set_int(swrCtx, "in_sample_fmt", aCodecCtx->sample_fmt, 0);
     av_opt_set_int(swrCtx, "in_sample_rate", aCodecCtx->sample_rate, 0);
@@ -568,7 +1028,11 @@ int main(int argc, char *argv[]) {
     wantedSpec.format = AUDIO_S16SYS;
     wantedSpec.channels = aCodecCtx->channels;
     wantedSpec.silence = 0;
-    wantedSpec.samples = SDL_AUDIO_BUFFER_SIZE;
+    // SDL needs a power of two.
+    wantedSpec.samples = 1;
+    while (wantedSpec.samples * 2 <= aCodecCtx->sample_rate * SDL_AUDIO_BUFFER_MS / 1000) {
+      wantedSpec.samples *= 2;
+    }
     wantedSpec.callback = audio_pull_from_queue;
     wantedSpec.userdata = aCodecCtx;
 
@@ -577,11 +1041,18 @@ int main(int argc, char *argv[]) {
       return -1;
     }
 
-    packet_queue_init(&audioQueue);
+    audio_queue_init();
     SDL_PauseAudio(0);
   }
 
-  // Wait for resize events to restart the player.
+  // Receiving and decoding never wait on the presentation below.
+  packet_queue_init(&videoQueue, VIDEO_QUEUE_MAX_BYTES, "video_queue_packets",
+                    "video_queue_bytes", "video_packets_dropped");
+  frame_queue_init(&videoFrames);
+  SDL_CreateThread(decode_thread, "decode", NULL);
+  SDL_CreateThread(receive_thread, "receive", NULL);
+
+  // The window appears at the first position, and stays until the end.
   while (1) {
     SDL_Event event;
     if (SDL_WaitEvent(&event) == 1) {
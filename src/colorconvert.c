@@ -0,0 +1,408 @@
+#include "colorconvert.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+
+// Byte offsets of each channel within a pixel.
+typedef struct {
+  enum AVPixelFormat format;
+  int bytesPerPixel;
+  int r;
+  int g;
+  int b;
+} PackedFormat;
+
+static const PackedFormat packedFormats[] = {
+  { AV_PIX_FMT_RGB24, 3, 0, 1, 2 },
+  { AV_PIX_FMT_BGR24, 3, 2, 1, 0 },
+  { AV_PIX_FMT_ARGB,  4, 1, 2, 3 },
+  { AV_PIX_FMT_ABGR,  4, 3, 2, 1 },
+  { AV_PIX_FMT_BGRA,  4, 2, 1, 0 },
+  { AV_PIX_FMT_RGBA,  4, 0, 1, 2 },
+};
+
+typedef void (*ConvertKernel)(const PackedFormat *fmt, int width, int rows,
+                              const uint8_t *src, int srcStride,
+                              uint8_t *const dst[3], const int dstStride[3]);
+
+static ConvertKernel convertKernel = NULL;
+static const char *convertIsa = NULL;
+
+
+static const PackedFormat *find_format(enum AVPixelFormat format) {
+  for (size_t i = 0; i < sizeof(packedFormats) / sizeof(packedFormats[0]); ++i) {
+    if (packedFormats[i].format == format) return &packedFormats[i];
+  }
+  return NULL;
+}
+
+
+static inline uint8_t luma(int r, int g, int b) {
+  return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+
+/**
+ * Converts columns `[x, width)` of a pair of rows, shared by every kernel
+ * for the pixels left over by the vector loop.
+**/
+static void convert_pair_c(const PackedFormat *fmt, int x, int width,
+                           const uint8_t *src0, const uint8_t *src1,
+                           uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+  const int bpp = fmt->bytesPerPixel;
+  for (; x < width; x += 2) {
+    const uint8_t *p[4] = {
+      src0 + x * bpp, src0 + (x + 1) * bpp,
+      src1 + x * bpp, src1 + (x + 1) * bpp
+    };
+    int r = 0, g = 0, b = 0;
+    for (int i = 0; i < 4; ++i) {
+      r += p[i][fmt->r];
+      g += p[i][fmt->g];
+      b += p[i][fmt->b];
+    }
+    y0[x] = luma(p[0][fmt->r], p[0][fmt->g], p[0][fmt->b]);
+    y0[x + 1] = luma(p[1][fmt->r], p[1][fmt->g], p[1][fmt->b]);
+    y1[x] = luma(p[2][fmt->r], p[2][fmt->g], p[2][fmt->b]);
+    y1[x + 1] = luma(p[3][fmt->r], p[3][fmt->g], p[3][fmt->b]);
+
+    r = (r + 2) >> 2;
+    g = (g + 2) >> 2;
+    b = (b + 2) >> 2;
+    u[x / 2] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v[x / 2] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+}
+
+
+static void convert_c(const PackedFormat *fmt, int width, int rows,
+                      const uint8_t *src, int srcStride,
+                      uint8_t *const dst[3], const int dstStride[3]) {
+  for (int row = 0; row < rows; row += 2) {
+    convert_pair_c(fmt, 0, width,
+                   src + row * srcStride, src + (row + 1) * srcStride,
+                   dst[0] + row * dstStride[0], dst[0] + (row + 1) * dstStride[0],
+                   dst[1] + row / 2 * dstStride[1], dst[2] + row / 2 * dstStride[2]);
+  }
+}
+
+
+#ifdef HAVE_X86
+
+/*
+ * The vector kernels work on 16-bit lanes. Every intermediate fits in 16
+ * unsigned bits: luma sums stay below 56228 and chroma sums are biased by
+ * 0x8080 (128 << 8 plus the rounding term) so they never go negative.
+ */
+
+static inline __m128i sse2_load4(const uint8_t *p, int bpp) {
+  if (bpp == 4) return _mm_loadu_si128((const __m128i *)p);
+
+  // Spread 4 packed 24-bit pixels into 32-bit lanes, the top byte is junk.
+  uint32_t a, b, c, d;
+  memcpy(&a, p, 4);
+  memcpy(&b, p + 3, 4);
+  memcpy(&c, p + 6, 4);
+  memcpy(&d, p + 9, 4);
+  return _mm_set_epi32((int)d, (int)c, (int)b, (int)a);
+}
+
+
+static inline __m128i sse2_channel(__m128i px0, __m128i px1, int offset) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  const __m128i shift = _mm_cvtsi32_si128(offset * 8);
+  return _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(px0, shift), mask),
+                         _mm_and_si128(_mm_srl_epi32(px1, shift), mask));
+}
+
+
+static inline __m128i sse2_luma(__m128i r, __m128i g, __m128i b) {
+  __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                            _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+  y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+  y = _mm_add_epi16(y, _mm_set1_epi16(128));
+  return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+
+// Averages 2x2 blocks of two rows of 8 samples into 4 samples.
+static inline __m128i sse2_average(__m128i row0, __m128i row1) {
+  __m128i sum = _mm_madd_epi16(_mm_add_epi16(row0, row1), _mm_set1_epi16(1));
+  sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+  return _mm_packs_epi32(sum, sum);
+}
+
+
+static inline __m128i sse2_chroma(__m128i a, __m128i ca, __m128i b, __m128i cb,
+                                  __m128i c, __m128i cc) {
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(a, ca), _mm_set1_epi16((short)0x8080));
+  x = _mm_sub_epi16(x, _mm_mullo_epi16(b, cb));
+  x = _mm_sub_epi16(x, _mm_mullo_epi16(c, cc));
+  return _mm_srli_epi16(x, 8);
+}
+
+
+static void convert_sse2(const PackedFormat *fmt, int width, int rows,
+                         const uint8_t *src, int srcStride,
+                         uint8_t *const dst[3], const int dstStride[3]) {
+  const int bpp = fmt->bytesPerPixel;
+  // 24-bit loads read one byte past the last pixel, keep it in the row.
+  const int vectorWidth = bpp == 4 ? width & ~7 : (width - 1) & ~7;
+
+  for (int row = 0; row < rows; row += 2) {
+    const uint8_t *src0 = src + row * srcStride;
+    const uint8_t *src1 = src0 + srcStride;
+    uint8_t *y0 = dst[0] + row * dstStride[0];
+    uint8_t *y1 = y0 + dstStride[0];
+    uint8_t *u = dst[1] + row / 2 * dstStride[1];
+    uint8_t *v = dst[2] + row / 2 * dstStride[2];
+
+    int x = 0;
+    for (; x < vectorWidth; x += 8) {
+      __m128i a0 = sse2_load4(src0 + x * bpp, bpp);
+      __m128i b0 = sse2_load4(src0 + (x + 4) * bpp, bpp);
+      __m128i a1 = sse2_load4(src1 + x * bpp, bpp);
+      __m128i b1 = sse2_load4(src1 + (x + 4) * bpp, bpp);
+
+      __m128i r0 = sse2_channel(a0, b0, fmt->r);
+      __m128i g0 = sse2_channel(a0, b0, fmt->g);
+      __m128i bl0 = sse2_channel(a0, b0, fmt->b);
+      __m128i r1 = sse2_channel(a1, b1, fmt->r);
+      __m128i g1 = sse2_channel(a1, b1, fmt->g);
+      __m128i bl1 = sse2_channel(a1, b1, fmt->b);
+
+      __m128i luma0 = sse2_luma(r0, g0, bl0);
+      __m128i luma1 = sse2_luma(r1, g1, bl1);
+      __m128i lumas = _mm_packus_epi16(luma0, luma1);
+      _mm_storel_epi64((__m128i *)(y0 + x), lumas);
+      _mm_storel_epi64((__m128i *)(y1 + x), _mm_srli_si128(lumas, 8));
+
+      __m128i r = sse2_average(r0, r1);
+      __m128i g = sse2_average(g0, g1);
+      __m128i b = sse2_average(bl0, bl1);
+      __m128i cu = sse2_chroma(b, _mm_set1_epi16(112), r, _mm_set1_epi16(38), g, _mm_set1_epi16(74));
+      __m128i cv = sse2_chroma(r, _mm_set1_epi16(112), g, _mm_set1_epi16(94), b, _mm_set1_epi16(18));
+      __m128i chroma = _mm_packus_epi16(cu, cv);
+      int32_t uBytes = _mm_cvtsi128_si32(chroma);
+      int32_t vBytes = _mm_cvtsi128_si32(_mm_srli_si128(chroma, 8));
+      memcpy(u + x / 2, &uBytes, 4);
+      memcpy(v + x / 2, &vBytes, 4);
+    }
+
+    convert_pair_c(fmt, x, width, src0, src1, y0, y1, u, v);
+  }
+}
+
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m128i avx2_load4(const uint8_t *p, int bpp) {
+  if (bpp == 4) return _mm_loadu_si128((const __m128i *)p);
+
+  // Spread 4 packed 24-bit pixels into 32-bit lanes, the top byte is zero.
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                       6, 7, 8, -1, 9, 10, 11, -1);
+  return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), spread);
+}
+
+
+// Loads pixels 0-3 and 8-11 into `a`, 4-7 and 12-15 into `b`, so packing
+// their channels keeps the 16 pixels in order across both lanes.
+static inline AVX2 void avx2_load16(const uint8_t *p, int bpp, __m256i *a, __m256i *b) {
+  *a = _mm256_inserti128_si256(_mm256_castsi128_si256(avx2_load4(p, bpp)),
+                               avx2_load4(p + 8 * bpp, bpp), 1);
+  *b = _mm256_inserti128_si256(_mm256_castsi128_si256(avx2_load4(p + 4 * bpp, bpp)),
+                               avx2_load4(p + 12 * bpp, bpp), 1);
+}
+
+
+static inline AVX2 __m256i avx2_channel(__m256i px0, __m256i px1, int offset) {
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  const __m128i shift = _mm_cvtsi32_si128(offset * 8);
+  return _mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(px0, shift), mask),
+                            _mm256_and_si256(_mm256_srl_epi32(px1, shift), mask));
+}
+
+
+static inline AVX2 __m256i avx2_luma(__m256i r, __m256i g, __m256i b) {
+  __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                               _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+  y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+  y = _mm256_add_epi16(y, _mm256_set1_epi16(128));
+  return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+
+// Averages 2x2 blocks of two rows of 16 samples into 8, each lane holds
+// its 4 results twice.
+static inline AVX2 __m256i avx2_average(__m256i row0, __m256i row1) {
+  __m256i sum = _mm256_madd_epi16(_mm256_add_epi16(row0, row1), _mm256_set1_epi16(1));
+  sum = _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(2)), 2);
+  return _mm256_packs_epi32(sum, sum);
+}
+
+
+static inline AVX2 __m256i avx2_chroma(__m256i a, int ca, __m256i b, int cb,
+                                       __m256i c, int cc) {
+  __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_set1_epi16((short)ca)),
+                               _mm256_set1_epi16((short)0x8080));
+  x = _mm256_sub_epi16(x, _mm256_mullo_epi16(b, _mm256_set1_epi16((short)cb)));
+  x = _mm256_sub_epi16(x, _mm256_mullo_epi16(c, _mm256_set1_epi16((short)cc)));
+  return _mm256_srli_epi16(x, 8);
+}
+
+
+static AVX2 void convert_avx2(const PackedFormat *fmt, int width, int rows,
+                              const uint8_t *src, int srcStride,
+                              uint8_t *const dst[3], const int dstStride[3]) {
+  const int bpp = fmt->bytesPerPixel;
+  // 24-bit loads read 4 bytes past the last pixel, keep them in the row.
+  const int vectorWidth = bpp == 4 ? width & ~15 : (width - 2) & ~15;
+
+  for (int row = 0; row < rows; row += 2) {
+    const uint8_t *src0 = src + row * srcStride;
+    const uint8_t *src1 = src0 + srcStride;
+    uint8_t *y0 = dst[0] + row * dstStride[0];
+    uint8_t *y1 = y0 + dstStride[0];
+    uint8_t *u = dst[1] + row / 2 * dstStride[1];
+    uint8_t *v = dst[2] + row / 2 * dstStride[2];
+
+    int x = 0;
+    for (; x < vectorWidth; x += 16) {
+      __m256i a0, b0, a1, b1;
+      avx2_load16(src0 + x * bpp, bpp, &a0, &b0);
+      avx2_load16(src1 + x * bpp, bpp, &a1, &b1);
+
+      __m256i r0 = avx2_channel(a0, b0, fmt->r);
+      __m256i g0 = avx2_channel(a0, b0, fmt->g);
+      __m256i bl0 = avx2_channel(a0, b0, fmt->b);
+      __m256i r1 = avx2_channel(a1, b1, fmt->r);
+      __m256i g1 = avx2_channel(a1, b1, fmt->g);
+      __m256i bl1 = avx2_channel(a1, b1, fmt->b);
+
+      // Packing interleaves the rows per lane, put each row back together.
+      __m256i lumas = _mm256_packus_epi16(avx2_luma(r0, g0, bl0), avx2_luma(r1, g1, bl1));
+      lumas = _mm256_permute4x64_epi64(lumas, _MM_SHUFFLE(3, 1, 2, 0));
+      _mm_storeu_si128((__m128i *)(y0 + x), _mm256_castsi256_si128(lumas));
+      _mm_storeu_si128((__m128i *)(y1 + x), _mm256_extracti128_si256(lumas, 1));
+
+      __m256i r = avx2_average(r0, r1);
+      __m256i g = avx2_average(g0, g1);
+      __m256i b = avx2_average(bl0, bl1);
+      __m256i chroma = _mm256_packus_epi16(avx2_chroma(b, 112, r, 38, g, 74),
+                                           avx2_chroma(r, 112, g, 94, b, 18));
+      // Lanes hold U0-3 U0-3 V0-3 V0-3 and U4-7 U4-7 V4-7 V4-7.
+      chroma = _mm256_permutevar8x32_epi32(chroma, _mm256_setr_epi32(0, 4, 2, 6, 1, 5, 3, 7));
+      __m128i uv = _mm256_castsi256_si128(chroma);
+      _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+      _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+    }
+
+    convert_pair_c(fmt, x, width, src0, src1, y0, y1, u, v);
+  }
+}
+
+#endif
+
+
+int color_convert_init(const char *isa) {
+  ConvertKernel kernel = convert_c;
+  const char *name = "c";
+
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  int haveAvx2 = __builtin_cpu_supports("avx2");
+  int haveSse2 = __builtin_cpu_supports("sse2");
+
+  if (isa ? strcmp(isa, "avx2") == 0 && haveAvx2 : haveAvx2) {
+    kernel = convert_avx2;
+    name = "avx2";
+  } else if (isa ? strcmp(isa, "sse2") == 0 && haveSse2 : haveSse2) {
+    kernel = convert_sse2;
+    name = "sse2";
+  }
+#endif
+
+  if (isa && strcmp(isa, name) != 0) {
+    return 0;
+  }
+  convertKernel = kernel;
+  convertIsa = name;
+  return 1;
+}
+
+
+const char *color_convert_isa(void) {
+  return convertIsa;
+}
+
+
+int color_convert_supported(enum AVPixelFormat format) {
+  return find_format(format) != NULL;
+}
+
+
+void color_convert_yuv420p(enum AVPixelFormat format, int width, int rows,
+                           const uint8_t *src, int srcStride,
+                           uint8_t *const dst[3], const int dstStride[3]) {
+  convertKernel(find_format(format), width, rows, src, srcStride, dst, dstStride);
+}
+
+
+int color_repack_supported(enum AVPixelFormat format) {
+  return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_NV12 ||
+         format == AV_PIX_FMT_YUYV422;
+}
+
+
+static void copy_rows(int rowSize, int rows, const uint8_t *src, int srcStride,
+                      uint8_t *dst, int dstStride) {
+  for (int row = 0; row < rows; ++row) {
+    memcpy(dst + row * dstStride, src + row * srcStride, (size_t)rowSize);
+  }
+}
+
+
+void color_repack_yuv420p(enum AVPixelFormat format, int width, int rows,
+                          const uint8_t *const src[3], const int srcStride[3],
+                          uint8_t *const dst[3], const int dstStride[3]) {
+  if (format == AV_PIX_FMT_YUV420P) {
+    copy_rows(width, rows, src[0], srcStride[0], dst[0], dstStride[0]);
+    copy_rows(width / 2, rows / 2, src[1], srcStride[1], dst[1], dstStride[1]);
+    copy_rows(width / 2, rows / 2, src[2], srcStride[2], dst[2], dstStride[2]);
+  } else if (format == AV_PIX_FMT_NV12) {
+    copy_rows(width, rows, src[0], srcStride[0], dst[0], dstStride[0]);
+    for (int row = 0; row < rows / 2; ++row) {
+      const uint8_t *uv = src[1] + row * srcStride[1];
+      uint8_t *u = dst[1] + row * dstStride[1];
+      uint8_t *v = dst[2] + row * dstStride[2];
+      for (int x = 0; x < width / 2; ++x) {
+        u[x] = uv[2 * x];
+        v[x] = uv[2 * x + 1];
+      }
+    }
+  } else {
+    // Y0 U Y1 V, chroma is shared by a pair of pixels.
+    for (int row = 0; row < rows; row += 2) {
+      const uint8_t *p0 = src[0] + row * srcStride[0];
+      const uint8_t *p1 = p0 + srcStride[0];
+      uint8_t *y0 = dst[0] + row * dstStride[0];
+      uint8_t *y1 = y0 + dstStride[0];
+      uint8_t *u = dst[1] + row / 2 * dstStride[1];
+      uint8_t *v = dst[2] + row / 2 * dstStride[2];
+      for (int x = 0; x < width / 2; ++x) {
+        y0[2 * x] = p0[4 * x];
+        y0[2 * x + 1] = p0[4 * x + 2];
+        y1[2 * x] = p1[4 * x];
+        y1[2 * x + 1] = p1[4 * x + 2];
+        u[x] = (uint8_t)((p0[4 * x + 1] + p1[4 * x + 1] + 1) >> 1);
+        v[x] = (uint8_t)((p0[4 * x + 3] + p1[4 * x + 3] + 1) >> 1);
+      }
+    }
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef CLOUDDISPLAY_COLORCONVERT_H
+#define CLOUDDISPLAY_COLORCONVERT_H
+
+#include <stdint.h>
+
+#include <libavutil/avutil.h>
+
+/**
+ * Packed RGB to YUV420P conversion at identical resolution, BT.601
+ * limited range like swscale. Chroma is the average of each 2x2 block.
+ *
+ * `color_convert_init()` must be called once before converting. It picks
+ * the best kernel for the CPU when `isa` is NULL, otherwise one of "avx2",
+ * "sse2" or "c". Returns 0 if the requested kernel is not available.
+**/
+int color_convert_init(const char *isa);
+
+const char *color_convert_isa(void);
+
+int color_convert_supported(enum AVPixelFormat format);
+
+/**
+ * Converts `rows` rows of `width` pixels. Both must be even.
+**/
+void color_convert_yuv420p(enum AVPixelFormat format, int width, int rows,
+                           const uint8_t *src, int srcStride,
+                           uint8_t *const dst[3], const int dstStride[3]);
+
+/**
+ * YUV420P, NV12 and YUYV422 to YUV420P at identical resolution. Nothing
+ * is computed: planes are copied, NV12 chroma is deinterleaved and YUYV422
+ * chroma is the average of each pair of rows.
+**/
+int color_repack_supported(enum AVPixelFormat format);
+
+/**
+ * Repacks `rows` rows of `width` pixels. Both must be even, `src` holds
+ * the planes of the input starting at the first row.
+**/
+void color_repack_yuv420p(enum AVPixelFormat format, int width, int rows,
+                          const uint8_t *const src[3], const int srcStride[3],
+                          uint8_t *const dst[3], const int dstStride[3]);
+
+#endif
@@ -0,0 +1,256 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Linear buckets per power of two, as a power of two.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+// Enough buckets for any positive int64_t.
+#define BUCKET_COUNT ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define MAX_METRICS 32
+#define MAX_NAME 32
+
+struct MetricsHistogram {
+  char name[MAX_NAME];
+  uint64_t buckets[BUCKET_COUNT];
+  uint64_t previous[BUCKET_COUNT]; // at the last report, only used by the reporter
+};
+
+struct MetricsCounter {
+  char name[MAX_NAME];
+  uint64_t value;
+  uint64_t previous;
+};
+
+struct MetricsGauge {
+  char name[MAX_NAME];
+  int64_t value;
+  int64_t max; // since the last report
+};
+
+// Registered metrics are never freed.
+static struct {
+  pthread_mutex_t mutex; // guards registration
+  MetricsHistogram *histograms[MAX_METRICS];
+  int histogramCount;
+  MetricsCounter *counters[MAX_METRICS];
+  int counterCount;
+  MetricsGauge *gauges[MAX_METRICS];
+  int gaugeCount;
+} registry = { PTHREAD_MUTEX_INITIALIZER, {0}, 0, {0}, 0, {0}, 0 };
+
+
+/**
+ * Looks `name` up in `metrics` or appends a new zeroed metric of `size`
+ * bytes, which must start with its name.
+**/
+static void *register_metric(void **metrics, int *count, size_t size, const char *name) {
+  pthread_mutex_lock(&registry.mutex);
+  for (int i = 0; i < *count; ++i) {
+    if (strcmp((const char *)metrics[i], name) == 0) {
+      pthread_mutex_unlock(&registry.mutex);
+      return metrics[i];
+    }
+  }
+
+  if (*count == MAX_METRICS || strlen(name) >= MAX_NAME) {
+    fprintf(stderr, "unable to register metric: %s\n", name);
+    exit(1);
+  }
+  char *metric = calloc(1, size);
+  if (!metric) {
+    fprintf(stderr, "unable to allocate metric: %s\n", name);
+    exit(1);
+  }
+  strcpy(metric, name);
+  // Published under the mutex, the reporter takes it before reading.
+  metrics[(*count)++] = metric;
+  pthread_mutex_unlock(&registry.mutex);
+  return metric;
+}
+
+
+MetricsHistogram *metrics_histogram(const char *name) {
+  return register_metric((void **)registry.histograms, &registry.histogramCount,
+                         sizeof(MetricsHistogram), name);
+}
+
+
+MetricsCounter *metrics_counter(const char *name) {
+  return register_metric((void **)registry.counters, &registry.counterCount,
+                         sizeof(MetricsCounter), name);
+}
+
+
+MetricsGauge *metrics_gauge(const char *name) {
+  return register_metric((void **)registry.gauges, &registry.gaugeCount,
+                         sizeof(MetricsGauge), name);
+}
+
+
+int64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+static int bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return (int)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+
+/**
+ * Smallest value falling into bucket `index`.
+**/
+static uint64_t bucket_value(int index) {
+  if (index < SUB_BUCKETS) {
+    return (uint64_t)index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+
+void metrics_record(MetricsHistogram *histogram, int64_t nanoseconds) {
+  uint64_t value = nanoseconds > 0 ? (uint64_t)nanoseconds : 0;
+  __atomic_fetch_add(&histogram->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+}
+
+
+int64_t metrics_record_since(MetricsHistogram *histogram, int64_t start) {
+  int64_t now = metrics_now();
+  metrics_record(histogram, now - start);
+  return now;
+}
+
+
+void metrics_add(MetricsCounter *counter, uint64_t value) {
+  __atomic_fetch_add(&counter->value, value, __ATOMIC_RELAXED);
+}
+
+
+void metrics_set(MetricsGauge *gauge, int64_t value) {
+  __atomic_store_n(&gauge->value, value, __ATOMIC_RELAXED);
+  int64_t max = __atomic_load_n(&gauge->max, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&gauge->max, &max, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+
+/**
+ * Writes the percentiles of what `histogram` recorded since the previous
+ * report, in microseconds.
+**/
+static void write_histogram(FILE *file, MetricsHistogram *histogram) {
+  static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char *labels[] = { "p50", "p90", "p99", "p999" };
+
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t total = 0;
+  int last = -1;
+  for (int i = 0; i < BUCKET_COUNT; ++i) {
+    uint64_t value = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    counts[i] = value - histogram->previous[i];
+    histogram->previous[i] = value;
+    total += counts[i];
+    if (counts[i]) last = i;
+  }
+
+  fprintf(file, "%s count=%llu", histogram->name, (unsigned long long)total);
+  if (total > 0) {
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+      // Nearest rank, rounded up.
+      double exact = percentiles[p] * (double)total;
+      uint64_t rank = (uint64_t)exact;
+      if ((double)rank < exact || rank < 1) ++rank;
+      while (seen + counts[bucket] < rank) seen += counts[bucket++];
+      fprintf(file, " %s=%.1fus", labels[p], (double)bucket_value(bucket) / 1000.0);
+    }
+    fprintf(file, " max=%.1fus", (double)bucket_value(last) / 1000.0);
+  }
+  fprintf(file, "\n");
+}
+
+
+static void write_report(FILE *file, double seconds) {
+  pthread_mutex_lock(&registry.mutex);
+  fprintf(file, "interval=%.3fs\n", seconds);
+  for (int i = 0; i < registry.histogramCount; ++i) {
+    write_histogram(file, registry.histograms[i]);
+  }
+  for (int i = 0; i < registry.counterCount; ++i) {
+    MetricsCounter *counter = registry.counters[i];
+    uint64_t value = __atomic_load_n(&counter->value, __ATOMIC_RELAXED);
+    fprintf(file, "%s total=%llu rate=%.1f/s\n", counter->name, (unsigned long long)value,
+            (double)(value - counter->previous) / seconds);
+    counter->previous = value;
+  }
+  for (int i = 0; i < registry.gaugeCount; ++i) {
+    MetricsGauge *gauge = registry.gauges[i];
+    int64_t value = __atomic_load_n(&gauge->value, __ATOMIC_RELAXED);
+    int64_t max = __atomic_exchange_n(&gauge->max, value, __ATOMIC_RELAXED);
+    fprintf(file, "%s value=%lld max=%lld\n", gauge->name, (long long)value,
+            (long long)(max > value ? max : value));
+  }
+  pthread_mutex_unlock(&registry.mutex);
+}
+
+
+static void *report_thread(void *arg) {
+  const char *path = arg;
+  size_t pathLength = strlen(path);
+  char *temporaryPath = malloc(pathLength + 5);
+  if (!temporaryPath) {
+    fprintf(stderr, "unable to allocate stats file name\n");
+    exit(1);
+  }
+  memcpy(temporaryPath, path, pathLength);
+  memcpy(temporaryPath + pathLength, ".tmp", 5);
+
+  int64_t previous = metrics_now();
+  struct timespec interval = { METRICS_INTERVAL_MS / 1000, (METRICS_INTERVAL_MS % 1000) * 1000000L };
+  while (1) {
+    while (nanosleep(&interval, &interval) < 0 && errno == EINTR) {}
+    interval.tv_sec = METRICS_INTERVAL_MS / 1000;
+    interval.tv_nsec = (METRICS_INTERVAL_MS % 1000) * 1000000L;
+
+    int64_t now = metrics_now();
+    FILE *file = fopen(temporaryPath, "w");
+    if (!file) {
+      // Metrics are not worth stopping for, try again next time.
+      continue;
+    }
+    write_report(file, (double)(now - previous) / 1e9);
+    previous = now;
+    if (fclose(file) == 0) {
+      rename(temporaryPath, path);
+    }
+  }
+  return NULL;
+}
+
+
+void metrics_start(const char *path) {
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, report_thread, strdup(path));
+  if (err != 0) {
+    fprintf(stderr, "unable to start metrics thread: %s\n", strerror(err));
+    exit(1);
+  }
+  pthread_detach(thread);
+}
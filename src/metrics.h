@@ -0,0 +1,57 @@
+#ifndef CLOUDDISPLAY_METRICS_H
+#define CLOUDDISPLAY_METRICS_H
+
+#include <stdint.h>
+
+// How often `metrics_start()` rewrites the stats file.
+#define METRICS_INTERVAL_MS 1000
+
+/**
+ * Counters, gauges and timing histograms shared by the encoder and the
+ * player. Recording is a handful of relaxed atomic operations and never
+ * takes a lock, so it stays on in production.
+ *
+ * Histograms keep 16 linear buckets per power of two of nanoseconds, like
+ * an HDR histogram with one significant digit, so percentiles are within
+ * about 6% of the recorded values.
+ *
+ * Metrics are registered by name, registering a name twice returns the
+ * same metric. They are only written out once `metrics_start()` is called.
+**/
+typedef struct MetricsHistogram MetricsHistogram;
+typedef struct MetricsCounter MetricsCounter;
+typedef struct MetricsGauge MetricsGauge;
+
+MetricsHistogram *metrics_histogram(const char *name);
+MetricsCounter *metrics_counter(const char *name);
+MetricsGauge *metrics_gauge(const char *name);
+
+/**
+ * Monotonic clock in nanoseconds, the time base of every histogram.
+**/
+int64_t metrics_now(void);
+
+void metrics_record(MetricsHistogram *histogram, int64_t nanoseconds);
+
+/**
+ * Records the time elapsed since `start` and returns the current time, so
+ * consecutive stages can be timed with a single clock read each.
+**/
+int64_t metrics_record_since(MetricsHistogram *histogram, int64_t start);
+
+void metrics_add(MetricsCounter *counter, uint64_t value);
+
+/**
+ * Sets the current value of `gauge`, the stats file also shows the highest
+ * value of each interval.
+**/
+void metrics_set(MetricsGauge *gauge, int64_t value);
+
+/**
+ * Starts a thread rewriting `path` every `METRICS_INTERVAL_MS` with the
+ * values recorded during the last interval. The file is replaced with
+ * rename(), so readers never see it half written.
+**/
+void metrics_start(const char *path);
+
+#endif
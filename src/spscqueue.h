@@ -0,0 +1,136 @@
+#ifndef CLOUDDISPLAY_SPSCQUEUE_H
+#define CLOUDDISPLAY_SPSCQUEUE_H
+
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Bounded single-producer/single-consumer queue of fixed size elements.
+ *
+ * The ring itself is lock-free: the producer only writes `head`, the
+ * consumer only writes `tail`. Semaphores are only used to sleep while
+ * the queue is full or empty and do not take a lock when uncontended.
+ *
+ * If `notify` is set it is posted after every push, which lets a consumer
+ * wait on several queues at once and then `spsc_queue_try_pop()` them.
+**/
+typedef struct {
+  uint8_t *elements;
+  size_t elementSize;
+  size_t capacity;
+  size_t head; // Next element to write, only written by the producer.
+  size_t tail; // Next element to read, only written by the consumer.
+  sem_t filled;
+  sem_t empty;
+  sem_t *notify;
+} SpscQueue;
+
+
+static inline void spsc_queue_init(SpscQueue *q, size_t capacity,
+                                   size_t elementSize, sem_t *notify) {
+  memset(q, 0, sizeof(SpscQueue));
+  q->elements = calloc(capacity, elementSize);
+  q->elementSize = elementSize;
+  q->capacity = capacity;
+  q->notify = notify;
+  if (!q->elements ||
+      sem_init(&q->filled, 0, 0) < 0 ||
+      sem_init(&q->empty, 0, (unsigned)capacity) < 0) {
+    perror("unable to create queue");
+    exit(1);
+  }
+}
+
+
+/**
+ * Frees the ring, the queue must no longer be used by either thread.
+**/
+static inline void spsc_queue_destroy(SpscQueue *q) {
+  sem_destroy(&q->filled);
+  sem_destroy(&q->empty);
+  free(q->elements);
+  q->elements = NULL;
+}
+
+
+static inline void spsc_queue_wait(sem_t *sem) {
+  // Retry when interrupted by a signal.
+  while (sem_wait(sem) < 0) {}
+}
+
+
+/**
+ * Appends a copy of `element`, blocking while the queue is full.
+**/
+static inline void spsc_queue_push(SpscQueue *q, const void *element) {
+  spsc_queue_wait(&q->empty);
+
+  size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  memcpy(q->elements + (head % q->capacity) * q->elementSize, element, q->elementSize);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+  sem_post(&q->filled);
+  if (q->notify) sem_post(q->notify);
+}
+
+
+/**
+ * Like `spsc_queue_push()` but returns 0 instead of blocking.
+**/
+static inline int spsc_queue_try_push(SpscQueue *q, const void *element) {
+  if (sem_trywait(&q->empty) < 0) {
+    return 0;
+  }
+
+  size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  memcpy(q->elements + (head % q->capacity) * q->elementSize, element, q->elementSize);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+  sem_post(&q->filled);
+  if (q->notify) sem_post(q->notify);
+  return 1;
+}
+
+
+static inline void spsc_queue_take(SpscQueue *q, void *element) {
+  size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  memcpy(element, q->elements + (tail % q->capacity) * q->elementSize, q->elementSize);
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+  sem_post(&q->empty);
+}
+
+
+/**
+ * Removes the oldest element into `element`, blocking while the queue is empty.
+**/
+static inline void spsc_queue_pop(SpscQueue *q, void *element) {
+  spsc_queue_wait(&q->filled);
+  spsc_queue_take(q, element);
+}
+
+
+/**
+ * Like `spsc_queue_pop()` but returns 0 instead of blocking.
+**/
+static inline int spsc_queue_try_pop(SpscQueue *q, void *element) {
+  if (sem_trywait(&q->filled) < 0) {
+    return 0;
+  }
+  spsc_queue_take(q, element);
+  return 1;
+}
+
+
+/**
+ * Number of queued elements. Only exact when called from the consumer.
+**/
+static inline size_t spsc_queue_size(SpscQueue *q) {
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,416 @@
+// sendmmsg() is Linux specific.
+#define _GNU_SOURCE
+
+#include "udpoutput.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "spscqueue.h"
+
+// Datagrams handed to a single sendmmsg() call at most.
+#define UDP_OUTPUT_BATCH 64
+// Datagrams sent back to back when pacing.
+#define PACING_BURST 8
+// Flushes queued per destination before it starts missing them.
+#define SINK_QUEUE_SIZE 16
+
+// Datagrams of one flush, shared by every destination. Each of them
+// holds a reference, the last one to release it frees it.
+typedef struct {
+  int refs;
+  int count;
+  int capacity;
+  int *sizes;
+  uint8_t *datagrams; // each one `UDP_OUTPUT_DATAGRAM_SIZE` bytes apart
+} Batch;
+
+// Held by its thread and by the output, the last one to release it frees it.
+typedef struct Sink {
+  struct Sink *next;
+  int refs;
+  char host[256];
+  char port[32];
+  int fd;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  int64_t pacingInterval;
+  SpscQueue batches; // NULL stops the thread once everything before it is sent
+  int stopping; // set to stop without sending what is queued
+  pthread_t thread;
+} Sink;
+
+struct UdpOutput {
+  pthread_mutex_t mutex; // guards `sinks`
+  Sink *sinks;
+  Sink *removed; // unlinked by `udp_output_remove()`, stopped by the next flush
+  int64_t pacingInterval;
+  AVIOContext *context;
+  Batch *batch; // being filled by the muxer
+};
+
+// Updated from every destination thread, hence atomically.
+static struct {
+  uint64_t datagrams;
+  uint64_t syscalls;
+  uint64_t bursts; // datagrams sent back to back
+  uint64_t maxBurst;
+  uint64_t dropped; // flushes missed by a destination with a full queue
+} outputStats;
+
+// Registered by the first `udp_output_open()`.
+static pthread_once_t metricsOnce = PTHREAD_ONCE_INIT;
+static MetricsCounter *bytesOut = NULL;
+static MetricsCounter *flushesDropped = NULL;
+
+
+static Batch *batch_alloc(void) {
+  Batch *batch = calloc(1, sizeof(Batch));
+  if (!batch) {
+    fprintf(stderr, "unable to allocate output datagrams\n");
+    exit(1);
+  }
+  batch->refs = 1;
+  return batch;
+}
+
+
+static void batch_release(Batch *batch) {
+  if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(batch->datagrams);
+    free(batch->sizes);
+    free(batch);
+  }
+}
+
+
+static int udp_output_write(void *opaque, uint8_t *buf, int size) {
+  UdpOutput *output = opaque;
+  Batch *batch = output->batch;
+
+  // The context buffer is a single datagram, so this is called once per
+  // datagram and with a short one when the context is flushed.
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : UDP_OUTPUT_BATCH;
+    batch->datagrams = realloc(batch->datagrams,
+                               (size_t)batch->capacity * UDP_OUTPUT_DATAGRAM_SIZE);
+    batch->sizes = realloc(batch->sizes, (size_t)batch->capacity * sizeof(int));
+    if (!batch->datagrams || !batch->sizes) {
+      fprintf(stderr, "unable to allocate output datagrams\n");
+      exit(1);
+    }
+  }
+
+  memcpy(batch->datagrams + (size_t)batch->count * UDP_OUTPUT_DATAGRAM_SIZE, buf, (size_t)size);
+  batch->sizes[batch->count++] = size;
+  return size;
+}
+
+
+static void update_max(uint64_t *max, uint64_t value) {
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(max, &current, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+
+/**
+ * Sends `count` datagrams of `batch` starting at `first`, in as few
+ * syscalls as the kernel allows.
+**/
+static void send_datagrams(Sink *sink, const Batch *batch, int first, int count) {
+  struct mmsghdr messages[UDP_OUTPUT_BATCH];
+  struct iovec vectors[UDP_OUTPUT_BATCH];
+
+  while (count > 0) {
+    int chunk = count < UDP_OUTPUT_BATCH ? count : UDP_OUTPUT_BATCH;
+    memset(messages, 0, sizeof(messages[0]) * (size_t)chunk);
+    for (int i = 0; i < chunk; ++i) {
+      vectors[i].iov_base = batch->datagrams + (size_t)(first + i) * UDP_OUTPUT_DATAGRAM_SIZE;
+      vectors[i].iov_len = (size_t)batch->sizes[first + i];
+      messages[i].msg_hdr.msg_name = &sink->address;
+      messages[i].msg_hdr.msg_namelen = sink->addressLength;
+      messages[i].msg_hdr.msg_iov = &vectors[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(sink->fd, messages, (unsigned)chunk, 0);
+    __atomic_fetch_add(&outputStats.syscalls, 1, __ATOMIC_RELAXED);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      // Like a lost datagram, the decoder copes with it.
+      fprintf(stderr, "unable to send datagrams to %s:%s: %s\n",
+              sink->host, sink->port, strerror(errno));
+      sent = chunk;
+    } else {
+      __atomic_fetch_add(&outputStats.datagrams, (uint64_t)sent, __ATOMIC_RELAXED);
+      uint64_t bytes = 0;
+      for (int i = 0; i < sent; ++i) bytes += messages[i].msg_len;
+      metrics_add(bytesOut, bytes);
+    }
+    first += sent;
+    count -= sent;
+  }
+}
+
+
+static void send_batch(Sink *sink, const Batch *batch) {
+  int bursts = 1;
+  int burstSize = batch->count;
+  if (sink->pacingInterval > 0) {
+    burstSize = PACING_BURST;
+    bursts = (batch->count + burstSize - 1) / burstSize;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int burst = 0; burst < bursts; ++burst) {
+    if (burst > 0) {
+      // Bursts are evenly spread, the first one leaves right away.
+      int64_t offset = sink->pacingInterval * burst / bursts;
+      struct timespec next = start;
+      next.tv_sec += (time_t)(offset / 1000000);
+      next.tv_nsec += (long)(offset % 1000000) * 1000;
+      if (next.tv_nsec >= 1000000000) {
+        ++next.tv_sec;
+        next.tv_nsec -= 1000000000;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+    }
+
+    int first = burst * burstSize;
+    int count = batch->count - first < burstSize ? batch->count - first : burstSize;
+    send_datagrams(sink, batch, first, count);
+
+    __atomic_fetch_add(&outputStats.bursts, 1, __ATOMIC_RELAXED);
+    update_max(&outputStats.maxBurst, (uint64_t)count);
+  }
+}
+
+
+static void sink_release(Sink *sink) {
+  if (__atomic_sub_fetch(&sink->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(sink->fd);
+    spsc_queue_destroy(&sink->batches);
+    free(sink);
+  }
+}
+
+
+/**
+ * Stops the thread of `sink` once it reaches the end of its queue, and
+ * releases the reference of the output.
+**/
+static void sink_stop(Sink *sink, int wait) {
+  pthread_t thread = sink->thread;
+  Batch *end = NULL;
+  spsc_queue_push(&sink->batches, &end);
+  if (wait) {
+    pthread_join(thread, NULL);
+  } else {
+    pthread_detach(thread);
+  }
+  sink_release(sink);
+}
+
+
+static void *sink_thread(void *arg) {
+  Sink *sink = arg;
+
+  while (1) {
+    Batch *batch = NULL;
+    spsc_queue_pop(&sink->batches, &batch);
+    if (!batch) break;
+    if (!__atomic_load_n(&sink->stopping, __ATOMIC_RELAXED)) {
+      send_batch(sink, batch);
+    }
+    batch_release(batch);
+  }
+
+  sink_release(sink);
+  return NULL;
+}
+
+
+static void register_metrics(void) {
+  bytesOut = metrics_counter("bytes_out");
+  flushesDropped = metrics_counter("flushes_dropped");
+}
+
+
+UdpOutput *udp_output_open(int64_t pacingInterval) {
+  pthread_once(&metricsOnce, register_metrics);
+
+  UdpOutput *output = calloc(1, sizeof(UdpOutput));
+  if (!output) {
+    fprintf(stderr, "unable to allocate output\n");
+    exit(1);
+  }
+  pthread_mutex_init(&output->mutex, NULL);
+  output->pacingInterval = pacingInterval;
+  output->batch = batch_alloc();
+
+  unsigned char *buffer = av_malloc(UDP_OUTPUT_DATAGRAM_SIZE);
+  output->context = avio_alloc_context(buffer, UDP_OUTPUT_DATAGRAM_SIZE, 1, output,
+                                       NULL, udp_output_write, NULL);
+  if (!buffer || !output->context) {
+    fprintf(stderr, "unable to allocate output context\n");
+    exit(1);
+  }
+  output->context->seekable = 0;
+  output->context->max_packet_size = UDP_OUTPUT_DATAGRAM_SIZE;
+  return output;
+}
+
+
+int udp_output_add(UdpOutput *output, const char *host, const char *port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo *addresses = NULL;
+  int err = getaddrinfo(host, port, &hints, &addresses);
+  if (err != 0) {
+    fprintf(stderr, "unable to resolve %s:%s: %s\n", host, port, gai_strerror(err));
+    return 0;
+  }
+
+  Sink *sink = calloc(1, sizeof(Sink));
+  if (!sink) {
+    fprintf(stderr, "unable to allocate destination\n");
+    exit(1);
+  }
+  snprintf(sink->host, sizeof(sink->host), "%s", host);
+  snprintf(sink->port, sizeof(sink->port), "%s", port);
+  sink->fd = socket(addresses->ai_family, SOCK_DGRAM, 0);
+  if (sink->fd < 0) {
+    perror("unable to create socket");
+    exit(1);
+  }
+  // Not connected, like the udp:// protocol, so a receiver that is not
+  // listening yet does not make sending fail with ECONNREFUSED.
+  memcpy(&sink->address, addresses->ai_addr, addresses->ai_addrlen);
+  sink->addressLength = addresses->ai_addrlen;
+  freeaddrinfo(addresses);
+
+  sink->refs = 2;
+  sink->pacingInterval = output->pacingInterval;
+  spsc_queue_init(&sink->batches, SINK_QUEUE_SIZE, sizeof(Batch *), NULL);
+  err = pthread_create(&sink->thread, NULL, sink_thread, sink);
+  if (err != 0) {
+    fprintf(stderr, "unable to start thread: %s\n", strerror(err));
+    exit(1);
+  }
+
+  pthread_mutex_lock(&output->mutex);
+  sink->next = output->sinks;
+  output->sinks = sink;
+  pthread_mutex_unlock(&output->mutex);
+  return 1;
+}
+
+
+int udp_output_remove(UdpOutput *output, const char *host, const char *port) {
+  pthread_mutex_lock(&output->mutex);
+  for (Sink **link = &output->sinks; *link; link = &(*link)->next) {
+    Sink *sink = *link;
+    if (strcmp(sink->host, host) == 0 && strcmp(sink->port, port) == 0) {
+      // Only the flushing thread may push to the queue, it stops the sink.
+      *link = sink->next;
+      sink->next = output->removed;
+      output->removed = sink;
+      __atomic_store_n(&sink->stopping, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&output->mutex);
+      return 1;
+    }
+  }
+  pthread_mutex_unlock(&output->mutex);
+  return 0;
+}
+
+
+AVIOContext *udp_output_context(UdpOutput *output) {
+  return output->context;
+}
+
+
+void udp_output_flush(UdpOutput *output) {
+  Batch *batch = output->batch;
+  if (batch->count == 0) return;
+  output->batch = batch_alloc();
+
+  pthread_mutex_lock(&output->mutex);
+  Sink *removed = output->removed;
+  output->removed = NULL;
+  for (Sink *sink = output->sinks; sink; sink = sink->next) {
+    __atomic_add_fetch(&batch->refs, 1, __ATOMIC_RELAXED);
+    if (!spsc_queue_try_push(&sink->batches, &batch)) {
+      // A slow destination misses this flush rather than stall the others.
+      __atomic_fetch_add(&outputStats.dropped, 1, __ATOMIC_RELAXED);
+      metrics_add(flushesDropped, 1);
+      batch_release(batch);
+    }
+  }
+  pthread_mutex_unlock(&output->mutex);
+  batch_release(batch);
+
+  // Stopping sinks skip what is left in their queue, so this does not
+  // wait for them to send it.
+  while (removed) {
+    Sink *next = removed->next;
+    sink_stop(removed, 0);
+    removed = next;
+  }
+}
+
+
+void udp_output_close(UdpOutput *output) {
+  udp_output_flush(output);
+
+  pthread_mutex_lock(&output->mutex);
+  Sink *sinks = output->sinks;
+  Sink *removed = output->removed;
+  output->sinks = output->removed = NULL;
+  pthread_mutex_unlock(&output->mutex);
+
+  Sink *lists[] = { sinks, removed };
+  for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+    for (Sink *sink = lists[i]; sink;) {
+      Sink *next = sink->next;
+      sink_stop(sink, 1);
+      sink = next;
+    }
+  }
+
+  batch_release(output->batch);
+  av_free(output->context->buffer);
+  av_free(output->context);
+  pthread_mutex_destroy(&output->mutex);
+  free(output);
+}
+
+
+void udp_output_print_stats(void) {
+  if (outputStats.syscalls == 0) return;
+  fprintf(stderr, "sent %llu datagrams in %llu syscalls, %llu bursts of %.1f datagrams (max %llu)\n",
+          (unsigned long long)outputStats.datagrams,
+          (unsigned long long)outputStats.syscalls,
+          (unsigned long long)outputStats.bursts,
+          (double)outputStats.datagrams / (double)outputStats.bursts,
+          (unsigned long long)outputStats.maxBurst);
+  if (outputStats.dropped > 0) {
+    fprintf(stderr, "%llu flushes dropped for slow destinations\n",
+            (unsigned long long)outputStats.dropped);
+  }
+}
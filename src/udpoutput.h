@@ -0,0 +1,58 @@
+#ifndef CLOUDDISPLAY_UDPOUTPUT_H
+#define CLOUDDISPLAY_UDPOUTPUT_H
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+// Seven transport stream packets, the most that fit in a 1500 byte MTU.
+#define UDP_OUTPUT_DATAGRAM_SIZE (7 * 188)
+
+/**
+ * Custom AVIOContext fanning the transport stream out to UDP destinations.
+ * The muxer output is cut into `UDP_OUTPUT_DATAGRAM_SIZE` datagrams which
+ * are queued until `udp_output_flush()` hands them to every destination.
+ *
+ * Each destination has its own thread and queue and sends with as few
+ * `sendmmsg()` calls as possible. A destination whose queue is full misses
+ * the flush instead of holding up the others.
+ *
+ * With a non-zero `pacingInterval` (microseconds) each flush is spread
+ * over that interval in short bursts instead of being sent at once.
+**/
+typedef struct UdpOutput UdpOutput;
+
+UdpOutput *udp_output_open(int64_t pacingInterval);
+
+/**
+ * Adds a destination, returns 0 if `host` and `port` do not resolve.
+ * May be called from any thread.
+**/
+int udp_output_add(UdpOutput *output, const char *host, const char *port);
+
+/**
+ * Removes a destination added with the same `host` and `port`, returns 0
+ * if there is none. May be called from any thread.
+**/
+int udp_output_remove(UdpOutput *output, const char *host, const char *port);
+
+AVIOContext *udp_output_context(UdpOutput *output);
+
+/**
+ * Sends the datagrams queued so far, the last one possibly short. Call it
+ * after flushing the AVIOContext so it holds every complete packet.
+**/
+void udp_output_flush(UdpOutput *output);
+
+/**
+ * Waits until every destination sent what was flushed to it, then frees
+ * `output` and its AVIOContext.
+**/
+void udp_output_close(UdpOutput *output);
+
+/**
+ * Prints syscall and burst counts of every output to stderr.
+**/
+void udp_output_print_stats(void);
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "../src/colorconvert.h"
+
+/**
+ * Checks `src/colorconvert.c`, run by `make test`:
+ *
+ * 1. Every vector kernel the CPU has produces exactly what the scalar
+ *    kernel does, for every packed format, every even width up to 130
+ *    (every tail length of the vector loops) and 1920, from unaligned rows
+ *    with odd strides, without reading or writing past the rows.
+ * 2. Every kernel and the YUV repacking stay within rounding of
+ *    `sws_scale()` with the flags the encoder uses for other conversions.
+ *
+ * Widths are even: the encoder only takes even sizes and the kernels
+ * require them. Prints the failures and exits with 1 if there are any.
+**/
+
+#define ROWS 6
+#define MAX_SMALL_WIDTH 130
+#define LARGE_WIDTH 1920
+// Bytes between the end of a destination row and the next one, they must
+// stay untouched.
+#define CANARY_SIZE 16
+#define CANARY 0xA5
+
+// Largest difference from swscale: luma and chroma are computed with
+// coarser coefficients, chroma with a 2x2 box instead of swscale's filter.
+#define SWS_LUMA_TOLERANCE 1
+#define SWS_CHROMA_TOLERANCE 2
+
+static const enum AVPixelFormat packedFormats[] = {
+  AV_PIX_FMT_RGB24, AV_PIX_FMT_BGR24, AV_PIX_FMT_ARGB,
+  AV_PIX_FMT_ABGR, AV_PIX_FMT_BGRA, AV_PIX_FMT_RGBA,
+};
+
+static const enum AVPixelFormat repackFormats[] = {
+  AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12, AV_PIX_FMT_YUYV422,
+};
+
+static const char *isas[] = { "c", "sse2", "avx2" };
+
+static int failures = 0;
+
+
+typedef struct {
+  uint8_t *buffer;
+  uint8_t *data[3];
+  int linesize[3];
+} Picture;
+
+
+static void *allocate(size_t size) {
+  void *p = malloc(size);
+  if (!p) {
+    fprintf(stderr, "unable to allocate %zu bytes\n", size);
+    exit(1);
+  }
+  return p;
+}
+
+
+/**
+ * Source planes of `format`, filled with `pattern`. Each plane ends right
+ * after its last pixel and starts one byte off alignment, with an odd
+ * stride, so over-reads and alignment assumptions show up.
+**/
+static void alloc_source(Picture *picture, enum AVPixelFormat format, int width, int rows,
+                         int smooth, unsigned seed) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+  int planes = av_pix_fmt_count_planes(format);
+  int rowSizes[3] = { 0, 0, 0 };
+  int planeRows[3] = { rows, rows / 2, rows / 2 };
+  if (planes == 1) {
+    rowSizes[0] = width * av_get_padded_bits_per_pixel(desc) / 8;
+  } else {
+    rowSizes[0] = width;
+    rowSizes[1] = planes == 2 ? width : width / 2;
+    rowSizes[2] = width / 2;
+  }
+
+  size_t offsets[3];
+  size_t size = 0;
+  for (int i = 0; i < planes; ++i) {
+    picture->linesize[i] = rowSizes[i] + 3;
+    offsets[i] = size + 1;
+    size = offsets[i] + (size_t)(planeRows[i] - 1) * picture->linesize[i] + rowSizes[i];
+  }
+  picture->buffer = allocate(size);
+  memset(picture->buffer, 0, size);
+
+  srand(seed);
+  for (int i = 0; i < planes; ++i) {
+    picture->data[i] = picture->buffer + offsets[i];
+    for (int y = 0; y < planeRows[i]; ++y) {
+      uint8_t *row = picture->data[i] + y * picture->linesize[i];
+      for (int x = 0; x < rowSizes[i]; ++x) {
+        if (smooth) {
+          // Gentle ramps, where swscale's chroma filter and a box agree.
+          int t = (x / 4) * (1 + x % 3) + y * (2 + i) + 40 * i;
+          t %= 400;
+          row[x] = (uint8_t)(28 + (t < 200 ? t : 399 - t));
+        } else {
+          row[x] = (uint8_t)(rand() & 0xFF);
+        }
+      }
+    }
+  }
+}
+
+
+static void alloc_output(Picture *picture, int width, int rows) {
+  int rowSizes[3] = { width, width / 2, width / 2 };
+  int planeRows[3] = { rows, rows / 2, rows / 2 };
+  size_t offsets[3];
+  size_t size = 0;
+  for (int i = 0; i < 3; ++i) {
+    picture->linesize[i] = rowSizes[i] + CANARY_SIZE;
+    offsets[i] = size;
+    size += (size_t)planeRows[i] * picture->linesize[i];
+  }
+  picture->buffer = allocate(size);
+  memset(picture->buffer, CANARY, size);
+  for (int i = 0; i < 3; ++i) {
+    picture->data[i] = picture->buffer + offsets[i];
+  }
+}
+
+
+static void convert(enum AVPixelFormat format, int width, int rows,
+                    const Picture *source, Picture *output) {
+  if (color_convert_supported(format)) {
+    color_convert_yuv420p(format, width, rows, source->data[0], source->linesize[0],
+                          output->data, output->linesize);
+  } else {
+    color_repack_yuv420p(format, width, rows, (const uint8_t *const *)source->data,
+                         source->linesize, output->data, output->linesize);
+  }
+}
+
+
+static void sws_convert(enum AVPixelFormat format, int width, int rows,
+                        const Picture *source, Picture *output) {
+  struct SwsContext *context = sws_getContext(width, rows, format, width, rows,
+                                              AV_PIX_FMT_YUV420P, SWS_BICUBIC,
+                                              NULL, NULL, NULL);
+  if (!context) {
+    fprintf(stderr, "unable to create swscale context\n");
+    exit(1);
+  }
+  sws_scale(context, (const uint8_t *const *)source->data, source->linesize, 0, rows,
+            output->data, output->linesize);
+  sws_freeContext(context);
+}
+
+
+/**
+ * Compares the pixels of `actual` with `expected`, which may be off by
+ * `lumaTolerance` and `chromaTolerance`, and checks that the bytes past
+ * the end of every row of `actual` were left alone.
+**/
+static void compare(const char *label, enum AVPixelFormat format, int width, int rows,
+                    const Picture *actual, const Picture *expected,
+                    int lumaTolerance, int chromaTolerance) {
+  static const char *planeNames[] = { "Y", "U", "V" };
+  int rowSizes[3] = { width, width / 2, width / 2 };
+  int planeRows[3] = { rows, rows / 2, rows / 2 };
+
+  for (int i = 0; i < 3; ++i) {
+    int tolerance = i == 0 ? lumaTolerance : chromaTolerance;
+    int worst = 0, worstX = 0, worstY = 0;
+    int overwritten = 0;
+    for (int y = 0; y < planeRows[i]; ++y) {
+      const uint8_t *a = actual->data[i] + y * actual->linesize[i];
+      const uint8_t *e = expected->data[i] + y * expected->linesize[i];
+      for (int x = 0; x < rowSizes[i]; ++x) {
+        int difference = abs(a[x] - e[x]);
+        if (difference > worst) {
+          worst = difference;
+          worstX = x;
+          worstY = y;
+        }
+      }
+      for (int x = rowSizes[i]; x < actual->linesize[i]; ++x) {
+        overwritten |= a[x] != CANARY;
+      }
+    }
+    if (worst > tolerance || overwritten) {
+      ++failures;
+      printf("FAIL %s %s %dx%d %s: ", label, av_get_pix_fmt_name(format), width, rows,
+             planeNames[i]);
+      if (overwritten) {
+        printf("wrote past the end of a row\n");
+      } else {
+        printf("off by %d at %d,%d\n", worst, worstX, worstY);
+      }
+    }
+  }
+}
+
+
+static void check_format(enum AVPixelFormat format, int width, int rows) {
+  Picture source, reference, output;
+  char label[32];
+
+  // Vector kernels against the scalar one, bit for bit.
+  if (color_convert_supported(format)) {
+    alloc_source(&source, format, width, rows, 0, (unsigned)width);
+    alloc_output(&reference, width, rows);
+    color_convert_init("c");
+    convert(format, width, rows, &source, &reference);
+    for (size_t i = 1; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+      if (!color_convert_init(isas[i])) continue;
+      alloc_output(&output, width, rows);
+      convert(format, width, rows, &source, &output);
+      snprintf(label, sizeof(label), "%s/c", isas[i]);
+      compare(label, format, width, rows, &output, &reference, 0, 0);
+      free(output.buffer);
+    }
+    free(reference.buffer);
+    free(source.buffer);
+  }
+
+  // Every kernel against swscale, on content both can agree on.
+  alloc_source(&source, format, width, rows, 1, 0);
+  alloc_output(&reference, width, rows);
+  sws_convert(format, width, rows, &source, &reference);
+  for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i) {
+    if (!color_convert_init(isas[i])) continue;
+    alloc_output(&output, width, rows);
+    convert(format, width, rows, &source, &output);
+    snprintf(label, sizeof(label), "%s/swscale", isas[i]);
+    compare(label, format, width, rows, &output, &reference,
+            SWS_LUMA_TOLERANCE, SWS_CHROMA_TOLERANCE);
+    free(output.buffer);
+    // The repacking does not depend on the kernel.
+    if (!color_convert_supported(format)) break;
+  }
+  free(reference.buffer);
+  free(source.buffer);
+}
+
+
+int main(void) {
+  int checks = 0;
+  for (size_t f = 0; f < sizeof(packedFormats) / sizeof(packedFormats[0]); ++f) {
+    for (int width = 2; width <= MAX_SMALL_WIDTH; width += 2, ++checks) {
+      check_format(packedFormats[f], width, ROWS);
+    }
+    check_format(packedFormats[f], LARGE_WIDTH, ROWS);
+    ++checks;
+  }
+  for (size_t f = 0; f < sizeof(repackFormats) / sizeof(repackFormats[0]); ++f) {
+    for (int width = 2; width <= MAX_SMALL_WIDTH; width += 2, ++checks) {
+      check_format(repackFormats[f], width, ROWS);
+    }
+    check_format(repackFormats[f], LARGE_WIDTH, ROWS);
+    ++checks;
+  }
+
+  color_convert_init(NULL);
+  printf("%d sizes checked, best kernel %s, %d failures\n", checks, color_convert_isa(),
+         failures);
+  return failures ? 1 : 0;
+}